@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -37,9 +38,30 @@ typedef struct cache_details_t {
 	uint32_t Parent;
 	uint32_t LastUpdated;
 	uint32_t LastChecked;
+	uint32_t Duration;
 	time_t FileTime;
 } cache_details_t;
 
+// Details records written before durations were stored, converted by cache_migrate_details()
+#define DURATION_VERSION 2, 39, 0
+
+typedef struct cache_details_v0_t {
+	uint8_t Hash[SHA256_BLOCK_SIZE];
+	uint8_t BuildHash[SHA256_BLOCK_SIZE];
+	uint32_t Parent;
+	uint32_t LastUpdated;
+	uint32_t LastChecked;
+	time_t FileTime;
+} cache_details_v0_t;
+
+// Set in forked build workers. The stores are shared mappings with the parent so the worker must never write to them,
+// targets it creates get private indices starting at ForkedBase instead.
+static int CacheForked = 0;
+static size_t ForkedBase = 0;
+static const char **ForkedIds = NULL;
+static size_t ForkedSize = 0;
+static cache_details_t ForkedDetails[1];
+
 static int version_compare(int *A, int *B) {
 	if (A[0] < B[0]) return -1;
 	if (A[0] > B[0]) return 1;
@@ -77,6 +99,52 @@ static void cache_delete(const char *Path) {
 	}
 }
 
+static void cache_rename_store(const char *Path, const char *From, const char *To) {
+	// Stores consist of one or more files named after the store, renaming over the old files replaces them
+	DIR *Dir = opendir(Path);
+	if (!Dir) {
+		fprintf(stderr, "Failed to open cache directory %s: %s", Path, strerror(errno));
+		exit(-1);
+	}
+	size_t Length = strlen(From);
+	struct dirent *Entry = readdir(Dir);
+	while (Entry) {
+		if (!strncmp(Entry->d_name, From, Length) && (!Entry->d_name[Length] || Entry->d_name[Length] == '.')) {
+			const char *OldName = concat(Path, "/", Entry->d_name, NULL);
+			const char *NewName = concat(Path, "/", To, Entry->d_name + Length, NULL);
+			if (rename(OldName, NewName)) {
+				fprintf(stderr, "Failed to rename file %s: %s", OldName, strerror(errno));
+				exit(-1);
+			}
+			rewinddir(Dir);
+		}
+		Entry = readdir(Dir);
+	}
+	closedir(Dir);
+}
+
+static void cache_migrate_details(const char *CacheFileName) {
+	// Copies each details record into a new store with the current layout, durations of older records are unknown (0)
+	printf("Upgrading build database.\n");
+	fixed_store_t *OldStore = fixed_store_open(concat(CacheFileName, "/details", NULL), 0);
+	fixed_store_t *NewStore = fixed_store_create(concat(CacheFileName, "/migrate", NULL), sizeof(cache_details_t), 1024);
+	size_t Count = string_index0_num_entries(TargetsIndex);
+	for (size_t Index = 0; Index < Count; ++Index) {
+		cache_details_v0_t *Old = fixed_store_get(OldStore, Index);
+		cache_details_t *New = fixed_store_get(NewStore, Index);
+		memset(New, 0, sizeof(cache_details_t));
+		memcpy(New->Hash, Old->Hash, SHA256_BLOCK_SIZE);
+		memcpy(New->BuildHash, Old->BuildHash, SHA256_BLOCK_SIZE);
+		New->Parent = Old->Parent;
+		New->LastUpdated = Old->LastUpdated;
+		New->LastChecked = Old->LastChecked;
+		New->FileTime = Old->FileTime;
+	}
+	fixed_store_close(OldStore);
+	fixed_store_close(NewStore);
+	cache_rename_store(CacheFileName, "migrate", "details");
+}
+
 void cache_open(const char *RootPath) {
 	const char *CacheFileName = concat(RootPath, "/", SystemName, ".db", NULL);
 	struct stat Stat[1];
@@ -119,10 +187,11 @@ void cache_open(const char *RootPath) {
 			exit(-1);
 		}
 		MetadataStore = string_store_open(concat(CacheFileName, "/metadata", NULL), 0);
+		int Actual[3];
 		{
 			char Temp[16];
 			string_store_get(MetadataStore, CURRENT_VERSION_INDEX, Temp, 16);
-			int Current[3] = {CURRENT_VERSION}, Minimal[3] = {MINIMAL_VERSION}, Actual[3];
+			int Current[3] = {CURRENT_VERSION}, Minimal[3] = {MINIMAL_VERSION};
 			sscanf(Temp, "%d.%d.%d", Actual + 0, Actual + 1, Actual + 2);
 			if ((version_compare(Actual, Minimal) < 0) || (version_compare(Current, Actual) < 0)) {
 				printf("Version error: database was built with an incompatible version of Rabs, performing fresh build.\n");
@@ -133,6 +202,8 @@ void cache_open(const char *RootPath) {
 			}
 		}
 		TargetsIndex = string_index0_open(concat(CacheFileName, "/targets", NULL), 0);
+		int Duration[3] = {DURATION_VERSION};
+		if (version_compare(Actual, Duration) < 0) cache_migrate_details(CacheFileName);
 		DetailsStore = fixed_store_open(concat(CacheFileName, "/details", NULL), 0);
 		DependsStore = string_store_open(concat(CacheFileName, "/depends", NULL), 0);
 		ScansStore = string_store_open(concat(CacheFileName, "/scans", NULL), 0);
@@ -160,6 +231,7 @@ void cache_open(const char *RootPath) {
 }
 
 void cache_close() {
+	if (CacheForked) return;
 	string_store_close(MetadataStore);
 	string_index0_close(TargetsIndex);
 	fixed_store_close(DetailsStore);
@@ -183,8 +255,21 @@ void cache_bump_iteration() {
 	}
 }
 
+void cache_fork_child() {
+	CacheForked = 1;
+	ForkedBase = string_index0_num_entries(TargetsIndex);
+}
+
+static inline cache_details_t *cache_details(size_t Index) {
+	if (CacheForked && Index >= ForkedBase) {
+		memset(ForkedDetails, 0, sizeof(cache_details_t));
+		return ForkedDetails;
+	}
+	return fixed_store_get(DetailsStore, Index);
+}
+
 void cache_hash_get(target_t *Target, int *LastUpdated, int *LastChecked, time_t *FileTime, unsigned char Hash[SHA256_BLOCK_SIZE]) {
-	cache_details_t *Details = fixed_store_get(DetailsStore, Target->CacheIndex);
+	cache_details_t *Details = cache_details(Target->CacheIndex);
 	memcpy(Hash, Details->Hash, SHA256_BLOCK_SIZE);
 	*LastUpdated = Details->LastUpdated;
 	*LastChecked = Details->LastChecked;
@@ -192,6 +277,7 @@ void cache_hash_get(target_t *Target, int *LastUpdated, int *LastChecked, time_t
 }
 
 void cache_hash_set(target_t *Target, time_t FileTime) {
+	if (CacheForked) return;
 	cache_details_t *Details = fixed_store_get(DetailsStore, Target->CacheIndex);
 	memcpy(Details->Hash, Target->Hash, SHA256_BLOCK_SIZE);
 	Details->LastUpdated = Target->LastUpdated;
@@ -200,25 +286,40 @@ void cache_hash_set(target_t *Target, time_t FileTime) {
 }
 
 void cache_build_hash_get(target_t *Target, unsigned char Hash[SHA256_BLOCK_SIZE]) {
-	cache_details_t *Details = fixed_store_get(DetailsStore, Target->CacheIndex);
+	cache_details_t *Details = cache_details(Target->CacheIndex);
 	memcpy(Hash, Details->BuildHash, SHA256_BLOCK_SIZE);
 }
 
 void cache_build_hash_set(target_t *Target, unsigned char Hash[SHA256_BLOCK_SIZE]) {
+	if (CacheForked) return;
 	cache_details_t *Details = fixed_store_get(DetailsStore, Target->CacheIndex);
 	memcpy(Details->BuildHash, Hash, SHA256_BLOCK_SIZE);
 	if (Target->Parent) Details->Parent = Target->Parent->CacheIndex;
 }
 
 void cache_last_check_set(target_t *Target, time_t FileTime) {
+	if (CacheForked) return;
 	cache_details_t *Details = fixed_store_get(DetailsStore, Target->CacheIndex);
 	Details->LastUpdated = Target->LastUpdated;
 	Details->LastChecked = CurrentIteration;
 	Details->FileTime = FileTime;
 }
 
-target_t *cache_parent_get(target_t *Target) {
+int cache_duration_get(target_t *Target) {
+	cache_details_t *Details = cache_details(Target->CacheIndex);
+	uint32_t Duration = Details->Duration;
+	// 0 if never recorded, which is also the cost assumed for targets without a recorded duration
+	return Duration <= INT_MAX ? Duration : 0;
+}
+
+void cache_duration_set(target_t *Target, int Duration) {
+	if (CacheForked) return;
 	cache_details_t *Details = fixed_store_get(DetailsStore, Target->CacheIndex);
+	Details->Duration = Duration;
+}
+
+target_t *cache_parent_get(target_t *Target) {
+	cache_details_t *Details = cache_details(Target->CacheIndex);
 	size_t Parent = Details->Parent;
 	if (!Parent) return NULL;
 	target_id_slot R = targetcache_index(Parent);
@@ -247,16 +348,16 @@ static int cache_target_set_index(target_t *Target, uint32_t **IndexP) {
 
 targetset_t *cache_depends_get(target_t *Target) {
 	size_t Length = string_store_size(DependsStore, Target->CacheIndex);
-	if (Length) {
-		uint32_t *Buffer = GC_MALLOC_ATOMIC(Length);
+	uint32_t *Buffer = NULL;
+	if (Length && !(CacheForked && Target->CacheIndex >= ForkedBase)) {
+		Buffer = GC_MALLOC_ATOMIC(Length);
 		string_store_get(DependsStore, Target->CacheIndex, Buffer, Length);
-		return cache_target_set_parse(Buffer);
-	} else {
-		return targetset_new();
 	}
+	return cache_target_set_parse(Buffer);
 }
 
 void cache_depends_set(target_t *Target, targetset_t *Depends) {
+	if (CacheForked) return;
 	int Size = Depends->Size - Depends->Space;
 	uint32_t *Indices = anew(uint32_t, Size + 1);
 	Indices[0] = Size;
@@ -267,16 +368,16 @@ void cache_depends_set(target_t *Target, targetset_t *Depends) {
 
 targetset_t *cache_scan_get(target_t *Target) {
 	size_t Length = string_store_size(ScansStore, Target->CacheIndex);
-	if (Length) {
-		uint32_t *Buffer = GC_MALLOC_ATOMIC(Length);
+	uint32_t *Buffer = NULL;
+	if (Length && !(CacheForked && Target->CacheIndex >= ForkedBase)) {
+		Buffer = GC_MALLOC_ATOMIC(Length);
 		string_store_get(ScansStore, Target->CacheIndex, Buffer, Length);
-		return cache_target_set_parse(Buffer);
-	} else {
-		return targetset_new();
 	}
+	return cache_target_set_parse(Buffer);
 }
 
 void cache_scan_set(target_t *Target, targetset_t *Scans) {
+	if (CacheForked) return;
 	int Size = Scans->Size - Scans->Space;
 	uint32_t *Indices = anew(uint32_t, Size + 1);
 	Indices[0] = Size;
@@ -287,6 +388,7 @@ void cache_scan_set(target_t *Target, targetset_t *Scans) {
 
 ml_value_t *cache_expr_get(target_t *Target) {
 	size_t Length = string_store_size(ExprsStore, Target->CacheIndex);
+	if (CacheForked && Target->CacheIndex >= ForkedBase) Length = 0;
 	if (Length == INVALID_INDEX) return ml_error("IndexError", "Invalid index");
 	if (!Length) return NULL;
 	ml_cbor_reader_t *Cbor = ml_cbor_reader(NULL, NULL, NULL);
@@ -302,12 +404,26 @@ ml_value_t *cache_expr_get(target_t *Target) {
 }
 
 void cache_expr_set(target_t *Target, ml_value_t *Value) {
+	if (CacheForked) return;
 	string_store_writer_t Writer[1];
 	string_store_writer_open(Writer, ExprsStore, Target->CacheIndex);
 	ml_cbor_encode_to(Writer, (void *)string_store_writer_write, NULL, Value);
 }
 
 size_t cache_target_id_to_index(const char *Id) {
+	if (CacheForked) {
+		size_t Index = string_index0_search(TargetsIndex, Id, 0);
+		if (Index == INVALID_INDEX) {
+			if (ForkedSize % 64 == 0) {
+				const char **NewIds = anew(const char *, ForkedSize + 64);
+				if (ForkedIds) memcpy(NewIds, ForkedIds, ForkedSize * sizeof(const char *));
+				ForkedIds = NewIds;
+			}
+			ForkedIds[ForkedSize] = Id;
+			Index = ForkedBase + ForkedSize++;
+		}
+		return Index;
+	}
 	index_result_t Result = string_index0_insert2(TargetsIndex, Id, 0);
 	if (Result.Created) {
 		cache_details_t *Details = fixed_store_get(DetailsStore, Result.Index);
@@ -321,6 +437,7 @@ size_t cache_target_id_to_index_existing(const char *Id) {
 }
 
 const char *cache_target_index_to_id(size_t Index) {
+	if (CacheForked && Index >= ForkedBase) return ForkedIds[Index - ForkedBase];
 	size_t Size = string_index0_size(TargetsIndex, Index);
 	char *Id = GC_MALLOC_ATOMIC(Size + 1);
 	string_index0_get(TargetsIndex, Index, Id, Size);
@@ -331,3 +448,17 @@ const char *cache_target_index_to_id(size_t Index) {
 size_t cache_target_count() {
 	return string_index0_num_entries(TargetsIndex);
 }
+
+void cache_source_foreach(void *Data, cache_source_fn Callback) {
+	// Calls Callback for each target that had no build function or parent when it was last checked, until Callback returns non-zero.
+	static const uint8_t NoBuild[SHA256_BLOCK_SIZE] = {0,};
+	size_t Count = cache_target_count();
+	for (size_t Index = 0; Index < Count; ++Index) {
+		unsigned char Hash[SHA256_BLOCK_SIZE];
+		cache_details_t *Details = fixed_store_get(DetailsStore, Index);
+		int Source = Details->LastChecked && !Details->Parent && !memcmp(Details->BuildHash, NoBuild, SHA256_BLOCK_SIZE);
+		time_t FileTime = Details->FileTime;
+		memcpy(Hash, Details->Hash, SHA256_BLOCK_SIZE);
+		if (Source && Callback(Data, Index, cache_target_index_to_id(Index), FileTime, Hash)) return;
+	}
+}
@@ -9,12 +9,15 @@
 
 void cache_open(const char *RootPath);
 void cache_close();
+void cache_fork_child();
 
 void cache_hash_get(target_t *Target, int *LastUpdated, int *LastChecked, time_t *FileTime, unsigned char Digest[SHA256_BLOCK_SIZE]);
 void cache_hash_set(target_t *Target, time_t FileTime);
 void cache_build_hash_get(target_t *Target, unsigned char Hash[SHA256_BLOCK_SIZE]);
 void cache_build_hash_set(target_t *Target, unsigned char Hash[SHA256_BLOCK_SIZE]);
 void cache_last_check_set(target_t *Target, time_t FileTime);
+int cache_duration_get(target_t *Target);
+void cache_duration_set(target_t *Target, int Duration);
 
 target_t *cache_parent_get(target_t *Target);
 
@@ -35,4 +38,7 @@ size_t cache_target_id_to_index_existing(const char *Id);
 const char *cache_target_index_to_id(size_t Index);
 size_t cache_target_count();
 
+typedef int (*cache_source_fn)(void *Data, size_t Index, const char *Id, time_t FileTime, unsigned char Hash[SHA256_BLOCK_SIZE]);
+void cache_source_foreach(void *Data, cache_source_fn Callback);
+
 #endif
@@ -174,7 +174,10 @@ ML_METHOD("in", ContextT, MLFunctionT) {
 // Calls :mini:`Function()` in the context of :mini:`Context`.
 	context_t *OldContext = CurrentContext;
 	CurrentContext = (context_t *)Args[0];
+	target_t *OldSuspend = SuspendTarget;
+	SuspendTarget = NULL;
 	ml_value_t *Result = ml_simple_call(Args[1], 0, NULL);
+	SuspendTarget = OldSuspend;
 	if (Result->Type == MLErrorT) {
 		printf("Error: %s\n", ml_error_message(Result));
 		ml_source_t Source;
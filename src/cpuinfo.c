@@ -0,0 +1,71 @@
+#include "cpuinfo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef Linux
+#include <sched.h>
+
+static long cpuinfo_read_long(const char *FileName) {
+	FILE *File = fopen(FileName, "r");
+	if (!File) return -1;
+	long Value;
+	if (fscanf(File, "%ld", &Value) != 1) Value = -1;
+	fclose(File);
+	return Value;
+}
+
+static long cpuinfo_quota() {
+	// cgroup v2 first, then v1. Returns the number of CPUs the quota allows (rounded up) or -1 for no quota.
+	FILE *File = fopen("/sys/fs/cgroup/cpu.max", "r");
+	if (File) {
+		char Quota[32];
+		long Period;
+		long Limit = -1;
+		if (fscanf(File, "%31s %ld", Quota, &Period) == 2 && strcmp(Quota, "max") && Period > 0) {
+			Limit = (atol(Quota) + Period - 1) / Period;
+		}
+		fclose(File);
+		return Limit;
+	}
+	long Quota = cpuinfo_read_long("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+	long Period = cpuinfo_read_long("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+	if (Quota <= 0 || Period <= 0) return -1;
+	return (Quota + Period - 1) / Period;
+}
+#endif
+
+int cpuinfo_count() {
+	// Online CPUs, limited by the affinity mask and any cgroup CPU quota
+	long Count = sysconf(_SC_NPROCESSORS_ONLN);
+#ifdef Linux
+	cpu_set_t Set;
+	if (!sched_getaffinity(0, sizeof(Set), &Set)) {
+		int Affinity = CPU_COUNT(&Set);
+		if (Affinity > 0 && (Count <= 0 || Affinity < Count)) Count = Affinity;
+	}
+	long Quota = cpuinfo_quota();
+	if (Quota > 0 && (Count <= 0 || Quota < Count)) Count = Quota;
+#endif
+	return Count > 0 ? Count : 1;
+}
+
+int cpuinfo_times(cpuinfo_times_t *Times) {
+	// Aggregate CPU times from /proc/stat, returns 0 on success
+#ifdef Linux
+	FILE *File = fopen("/proc/stat", "r");
+	if (!File) return 1;
+	unsigned long long User, Nice, System, Idle, IOWait, IRQ, SoftIRQ, Steal;
+	int Count = fscanf(File, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &User, &Nice, &System, &Idle, &IOWait, &IRQ, &SoftIRQ, &Steal);
+	fclose(File);
+	if (Count < 5) return 1;
+	if (Count < 8) IRQ = SoftIRQ = Steal = 0;
+	Times->Idle = Idle;
+	Times->IOWait = IOWait;
+	Times->Total = User + Nice + System + Idle + IOWait + IRQ + SoftIRQ + Steal;
+	return 0;
+#else
+	return 1;
+#endif
+}
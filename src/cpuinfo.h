@@ -0,0 +1,11 @@
+#ifndef CPUINFO_H
+#define CPUINFO_H
+
+typedef struct {
+	unsigned long long Total, Idle, IOWait;
+} cpuinfo_times_t;
+
+int cpuinfo_count();
+int cpuinfo_times(cpuinfo_times_t *Times);
+
+#endif
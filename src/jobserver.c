@@ -0,0 +1,134 @@
+#include "jobserver.h"
+#include "target.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+// Implements both sides of the GNU make jobserver protocol: every running command needs a token,
+// the first command uses the token implicitly owned by this process and the rest read one from the pipe.
+
+enum {
+	TOKEN_NONE = -2,
+	TOKEN_IMPLICIT = -1
+};
+
+static pthread_mutex_t JobLock[1] = {PTHREAD_MUTEX_INITIALIZER};
+static int JobRead = -1, JobWrite = -1;
+static int ImplicitFree = 1;
+
+// Only a pipe created here can be resized. Tokens removed while in use are kept back when next released.
+static int JobOwned = 0, JobTokens = 0, JobDebt = 0;
+
+static int jobserver_parse(const char *MakeFlags) {
+	const char *Auth = strstr(MakeFlags, "--jobserver-auth=");
+	if (Auth) {
+		Auth += strlen("--jobserver-auth=");
+	} else if ((Auth = strstr(MakeFlags, "--jobserver-fds="))) {
+		Auth += strlen("--jobserver-fds=");
+	} else {
+		return 0;
+	}
+	if (!strncmp(Auth, "fifo:", 5)) {
+		const char *Path = Auth + 5;
+		size_t Length = strcspn(Path, " ");
+		char FifoPath[Length + 1];
+		memcpy(FifoPath, Path, Length);
+		FifoPath[Length] = 0;
+		int Fd = open(FifoPath, O_RDWR | O_CLOEXEC);
+		if (Fd < 0) return 0;
+		JobRead = JobWrite = Fd;
+		return 1;
+	}
+	int Read, Write;
+	if (sscanf(Auth, "%d,%d", &Read, &Write) != 2) return 0;
+	// make only passes the descriptors to recipes marked as recursive
+	if (fcntl(Read, F_GETFD) < 0 || fcntl(Write, F_GETFD) < 0) return 0;
+	JobRead = Read;
+	JobWrite = Write;
+	return 1;
+}
+
+void jobserver_init(int NumThreads) {
+#ifndef Mingw
+	const char *MakeFlags = getenv("MAKEFLAGS");
+	if (MakeFlags && jobserver_parse(MakeFlags)) return;
+	int Pipe[2];
+	if (pipe(Pipe)) return;
+	for (int I = 1; I < NumThreads; ++I) {
+		if (write(Pipe[1], "+", 1) != 1) break;
+	}
+	JobRead = Pipe[0];
+	JobWrite = Pipe[1];
+	JobOwned = 1;
+	JobTokens = NumThreads;
+	char *Flags;
+	asprintf(&Flags, "%s%s-j%d --jobserver-auth=%d,%d", MakeFlags ?: "", MakeFlags ? " " : "", NumThreads, JobRead, JobWrite);
+	setenv("MAKEFLAGS", Flags, 1);
+	free(Flags);
+#endif
+}
+
+void jobserver_fork_child() {
+	// The parent acquired a token for the worker before forking, it covers the worker's own commands
+	pthread_mutex_init(JobLock, NULL);
+	ImplicitFree = 1;
+	JobOwned = 0;
+	JobDebt = 0;
+}
+
+void jobserver_resize(int NumTokens) {
+	// Adds tokens to the pipe straight away, removing tokens waits until commands holding them finish
+	if (!JobOwned || NumTokens < 1) return;
+	pthread_mutex_lock(JobLock);
+	while (JobTokens < NumTokens) {
+		if (JobDebt) {
+			--JobDebt;
+		} else if (write(JobWrite, "+", 1) != 1) {
+			break;
+		}
+		++JobTokens;
+	}
+	while (JobTokens > NumTokens) {
+		++JobDebt;
+		--JobTokens;
+	}
+	pthread_mutex_unlock(JobLock);
+}
+
+int jobserver_acquire() {
+	if (JobRead < 0) return TOKEN_NONE;
+	pthread_mutex_lock(JobLock);
+	if (ImplicitFree) {
+		ImplicitFree = 0;
+		pthread_mutex_unlock(JobLock);
+		return TOKEN_IMPLICIT;
+	}
+	pthread_mutex_unlock(JobLock);
+	pthread_mutex_unlock(InterpreterLock);
+	unsigned char Token;
+	ssize_t Count;
+	do Count = read(JobRead, &Token, 1); while (Count < 0 && errno == EINTR);
+	pthread_mutex_lock(InterpreterLock);
+	return Count == 1 ? Token : TOKEN_NONE;
+}
+
+void jobserver_release(int Token) {
+	if (Token == TOKEN_NONE) return;
+	if (Token == TOKEN_IMPLICIT) {
+		pthread_mutex_lock(JobLock);
+		ImplicitFree = 1;
+		pthread_mutex_unlock(JobLock);
+	} else {
+		pthread_mutex_lock(JobLock);
+		int Keep = JobDebt > 0;
+		if (Keep) --JobDebt;
+		pthread_mutex_unlock(JobLock);
+		if (Keep) return;
+		unsigned char Char = Token;
+		while (write(JobWrite, &Char, 1) < 0 && errno == EINTR);
+	}
+}
@@ -0,0 +1,10 @@
+#ifndef JOBSERVER_H
+#define JOBSERVER_H
+
+void jobserver_init(int NumThreads);
+int jobserver_acquire();
+void jobserver_fork_child();
+void jobserver_release(int Token);
+void jobserver_resize(int NumTokens);
+
+#endif
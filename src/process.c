@@ -0,0 +1,311 @@
+#include "process.h"
+#include "ml_macros.h"
+#include <gc/gc.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <signal.h>
+
+#ifndef Mingw
+#include <sys/wait.h>
+#endif
+
+#ifdef Linux
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(Linux) && defined(SYS_pidfd_open)
+#define PROCESS_REACTOR
+#endif
+
+#define OUTPUT_NODE_SIZE 256
+
+typedef struct process_output_t process_output_t;
+
+struct process_output_t {
+	process_output_t *Next;
+	char Chars[OUTPUT_NODE_SIZE];
+};
+
+typedef struct process_t process_t;
+
+typedef struct {
+	process_t *Process;
+	int Fd;
+} process_source_t;
+
+struct process_t {
+	process_t *Next, **Prev;
+	process_done_fn Done;
+	void *Data;
+	process_source_t Output[1], Exit[1];
+	process_output_t *Head, *Current;
+	char *Chars;
+	size_t Total, Space;
+	pid_t Child;
+	int Capture, Pending, Status, Error;
+	pthread_cond_t Ready[1];
+};
+
+static void process_output_init(process_t *Process) {
+	Process->Head = Process->Current = new(process_output_t);
+	Process->Chars = Process->Current->Chars;
+	Process->Space = OUTPUT_NODE_SIZE;
+}
+
+static void process_output_add(process_t *Process, ssize_t Count) {
+	Process->Total += Count;
+	Process->Space -= Count;
+	if (!Process->Space) {
+		Process->Current = Process->Current->Next = new(process_output_t);
+		Process->Chars = Process->Current->Chars;
+		Process->Space = OUTPUT_NODE_SIZE;
+	} else {
+		Process->Chars += Count;
+	}
+}
+
+static char *process_output_get(process_t *Process) {
+	char *Chars = snew(Process->Total + 1);
+	char *End = Chars;
+	for (process_output_t *Output = Process->Head; Output != Process->Current; Output = Output->Next) {
+		memcpy(End, Output->Chars, OUTPUT_NODE_SIZE);
+		End += OUTPUT_NODE_SIZE;
+	}
+	memcpy(End, Process->Current->Chars, OUTPUT_NODE_SIZE - Process->Space);
+	Chars[Process->Total] = 0;
+	return Chars;
+}
+
+static int process_wait_sync(process_t *Process) {
+	int Output = Process->Output->Fd;
+	if (Output >= 0) {
+		if (Process->Capture) {
+			for (;;) {
+				ssize_t Count = read(Output, Process->Chars, Process->Space);
+				if (Count <= 0) break;
+				process_output_add(Process, Count);
+			}
+		} else {
+			char Chars[OUTPUT_NODE_SIZE];
+			for (;;) {
+				ssize_t Count = read(Output, Chars, OUTPUT_NODE_SIZE);
+				if (Count <= 0) break;
+			}
+		}
+		close(Output);
+	}
+	if (waitpid(Process->Child, &Process->Status, 0) == -1) return -1;
+	return 0;
+}
+
+#ifdef PROCESS_REACTOR
+
+static pthread_mutex_t ProcessLock[1] = {PTHREAD_MUTEX_INITIALIZER};
+static int Epoll = -1;
+
+// Processes waited for asynchronously, also keeps them reachable by the GC while only referenced from epoll.
+static process_t *AsyncProcesses = NULL;
+
+typedef struct process_watch_t process_watch_t;
+
+struct process_watch_t {
+	// Source must come first, watches are told apart from processes by a NULL Source->Process
+	process_source_t Source[1];
+	process_watch_t *Next, **Prev;
+	process_ready_fn Ready;
+	void *Data;
+};
+
+// Descriptors watched until they are readable, kept reachable like AsyncProcesses.
+static process_watch_t *AsyncWatches = NULL;
+
+static void process_watch_done(process_watch_t *Watch) {
+	// Watches only fire once, Ready may watch the same descriptor again
+	epoll_ctl(Epoll, EPOLL_CTL_DEL, Watch->Source->Fd, NULL);
+	pthread_mutex_lock(ProcessLock);
+	if ((Watch->Prev[0] = Watch->Next)) Watch->Next->Prev = Watch->Prev;
+	pthread_mutex_unlock(ProcessLock);
+	Watch->Ready(Watch->Data);
+}
+
+static void process_async_done(process_t *Process) {
+	// Called on the reactor thread once both the output and exit sources are done
+	pthread_mutex_lock(ProcessLock);
+	if ((Process->Prev[0] = Process->Next)) Process->Next->Prev = Process->Prev;
+	pthread_mutex_unlock(ProcessLock);
+	char *Chars = NULL;
+	if (Process->Capture && !Process->Error) Chars = process_output_get(Process);
+	Process->Done(Process->Data, Process->Error, Process->Status, Chars, Process->Total);
+}
+
+static void process_source_done(process_source_t *Source) {
+	process_t *Process = Source->Process;
+	epoll_ctl(Epoll, EPOLL_CTL_DEL, Source->Fd, NULL);
+	close(Source->Fd);
+	pthread_mutex_lock(ProcessLock);
+	int Pending = --Process->Pending;
+	process_done_fn Done = Process->Done;
+	if (!Pending && !Done) pthread_cond_signal(Process->Ready);
+	pthread_mutex_unlock(ProcessLock);
+	// A synchronous waiter may return as soon as it is signalled, taking Process with it
+	if (!Pending && Done) process_async_done(Process);
+}
+
+static void *process_thread_fn(void *Arg) {
+	struct epoll_event Events[64];
+	for (;;) {
+		int Count = epoll_wait(Epoll, Events, 64, -1);
+		for (int I = 0; I < Count; ++I) {
+			process_source_t *Source = (process_source_t *)Events[I].data.ptr;
+			process_t *Process = Source->Process;
+			if (!Process) {
+				process_watch_done((process_watch_t *)Source);
+			} else if (Source == Process->Exit) {
+				if (waitpid(Process->Child, &Process->Status, 0) == -1) Process->Error = 1;
+				process_source_done(Source);
+			} else if (Process->Capture) {
+				ssize_t Size = read(Source->Fd, Process->Chars, Process->Space);
+				if (Size > 0) {
+					process_output_add(Process, Size);
+				} else if (Size == 0 || errno != EINTR) {
+					process_source_done(Source);
+				}
+			} else {
+				char Chars[OUTPUT_NODE_SIZE];
+				ssize_t Size = read(Source->Fd, Chars, OUTPUT_NODE_SIZE);
+				if (Size == 0 || (Size < 0 && errno != EINTR)) process_source_done(Source);
+			}
+		}
+	}
+	return NULL;
+}
+
+static int process_source_add(process_source_t *Source) {
+	struct epoll_event Event = {0,};
+	Event.events = EPOLLIN;
+	Event.data.ptr = Source;
+	return epoll_ctl(Epoll, EPOLL_CTL_ADD, Source->Fd, &Event);
+}
+
+#endif
+
+void process_init() {
+#ifdef PROCESS_REACTOR
+	int PidFd = syscall(SYS_pidfd_open, getpid(), 0);
+	if (PidFd < 0) return;
+	close(PidFd);
+	Epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (Epoll < 0) return;
+	pthread_t Thread;
+	pthread_create(&Thread, NULL, process_thread_fn, NULL);
+	pthread_detach(Thread);
+#endif
+}
+
+void process_fork_child() {
+#ifdef PROCESS_REACTOR
+	// The reactor thread does not exist in a forked worker, fall back to waiting synchronously
+	pthread_mutex_init(ProcessLock, NULL);
+	Epoll = -1;
+	AsyncProcesses = NULL;
+	AsyncWatches = NULL;
+#endif
+}
+
+int process_wait_async(pid_t Child, int Output, int Capture, process_done_fn Done, void *Data) {
+	// Returns 0 if Done(Data, ...) will be called on the reactor thread when Child has exited and Output is closed,
+	// otherwise nothing has been started and the caller should use process_wait() instead.
+#ifdef PROCESS_REACTOR
+	if (Epoll < 0) return -1;
+	int PidFd = syscall(SYS_pidfd_open, Child, 0);
+	if (PidFd < 0) return -1;
+	process_t *Process = new(process_t);
+	Process->Output->Process = Process->Exit->Process = Process;
+	Process->Output->Fd = Output;
+	Process->Exit->Fd = PidFd;
+	Process->Child = Child;
+	Process->Capture = Capture;
+	Process->Done = Done;
+	Process->Data = Data;
+	if (Capture) process_output_init(Process);
+	pthread_mutex_lock(ProcessLock);
+	if ((Process->Next = AsyncProcesses)) AsyncProcesses->Prev = &Process->Next;
+	Process->Prev = &AsyncProcesses;
+	AsyncProcesses = Process;
+	Process->Pending = (Output >= 0) + 1;
+	if (Output >= 0) process_source_add(Process->Output);
+	process_source_add(Process->Exit);
+	pthread_mutex_unlock(ProcessLock);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+int process_watch_async(int Fd, process_ready_fn Ready, void *Data) {
+	// Returns 0 if Ready(Data) will be called on the reactor thread once Fd is readable or closed at the other end,
+	// otherwise the caller has to read from Fd synchronously.
+#ifdef PROCESS_REACTOR
+	if (Epoll < 0) return -1;
+	process_watch_t *Watch = new(process_watch_t);
+	Watch->Source->Fd = Fd;
+	Watch->Ready = Ready;
+	Watch->Data = Data;
+	pthread_mutex_lock(ProcessLock);
+	if ((Watch->Next = AsyncWatches)) AsyncWatches->Prev = &Watch->Next;
+	Watch->Prev = &AsyncWatches;
+	AsyncWatches = Watch;
+	pthread_mutex_unlock(ProcessLock);
+	if (!process_source_add(Watch->Source)) return 0;
+	pthread_mutex_lock(ProcessLock);
+	if ((Watch->Prev[0] = Watch->Next)) Watch->Next->Prev = Watch->Prev;
+	pthread_mutex_unlock(ProcessLock);
+	return -1;
+#else
+	return -1;
+#endif
+}
+
+void process_kill_async() {
+#ifdef PROCESS_REACTOR
+	pthread_mutex_lock(ProcessLock);
+	for (process_t *Process = AsyncProcesses; Process; Process = Process->Next) {
+		fprintf(stderr, "\e[31mKilling child process %d\n\e[0m", Process->Child);
+		killpg(Process->Child, SIGKILL);
+	}
+	pthread_mutex_unlock(ProcessLock);
+#endif
+}
+
+int process_wait(pid_t Child, int Output, int Capture, char **Chars, size_t *Length, int *Status) {
+	process_t Process[1] = {{NULL, NULL, NULL, NULL, {{Process, Output}}, {{Process, -1}},}};
+	Process->Child = Child;
+	Process->Capture = Capture;
+	if (Capture) process_output_init(Process);
+#ifdef PROCESS_REACTOR
+	if (Epoll >= 0 && (Process->Exit->Fd = syscall(SYS_pidfd_open, Child, 0)) >= 0) {
+		pthread_cond_init(Process->Ready, NULL);
+		pthread_mutex_lock(ProcessLock);
+		Process->Pending = (Output >= 0) + 1;
+		if (Output >= 0) process_source_add(Process->Output);
+		process_source_add(Process->Exit);
+		while (Process->Pending) pthread_cond_wait(Process->Ready, ProcessLock);
+		pthread_mutex_unlock(ProcessLock);
+		pthread_cond_destroy(Process->Ready);
+	} else if (process_wait_sync(Process)) {
+		return -1;
+	}
+#else
+	if (process_wait_sync(Process)) return -1;
+#endif
+	if (Process->Error) return -1;
+	if (Capture) {
+		*Chars = process_output_get(Process);
+		*Length = Process->Total;
+	}
+	*Status = Process->Status;
+	return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#include <unistd.h>
+#include <stddef.h>
+
+void process_init();
+void process_fork_child();
+int process_wait(pid_t Child, int Output, int Capture, char **Chars, size_t *Length, int *Status);
+
+typedef void (*process_done_fn)(void *Data, int Error, int Status, char *Chars, size_t Length);
+
+int process_wait_async(pid_t Child, int Output, int Capture, process_done_fn Done, void *Data);
+void process_kill_async();
+
+typedef void (*process_ready_fn)(void *Data);
+
+int process_watch_async(int Fd, process_ready_fn Ready, void *Data);
+
+#endif
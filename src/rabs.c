@@ -9,6 +9,8 @@
 #include <stdio.h>
 #include  <signal.h>
 #include "target.h"
+#include "target_file.h"
+#include "simulate.h"
 #include "context.h"
 #include "util.h"
 #include "cache.h"
@@ -23,6 +25,14 @@
 #include "rabs.h"
 #include "stringmap.h"
 #include "library.h"
+#include "targethash.h"
+#include "targetpool.h"
+#include "targetbatch.h"
+#include "worker.h"
+#include "targetqueue.h"
+#include "process.h"
+#include "jobserver.h"
+#include "cpuinfo.h"
 #include "ml_console.h"
 #include "whereami.h"
 
@@ -204,26 +214,10 @@ static ml_value_t *load_file(const char *FileName) {
 	return State->Result;
 }
 
-ML_FUNCTION(Subdir) {
-//<Name:string
-//>context|error
-// Creates a new directory subcontext with name :mini:`Name` and loads the :file:`build.rabs` file inside the directory.
-// Returns an error if the directory does not exist or does not contain a :file:`build.rabs` file.
-	ML_CHECK_ARG_COUNT(1);
-	ML_CHECK_ARG_TYPE(0, MLStringT);
-	const char *Path = ml_string_value(Args[0]);
-	Path = concat(CurrentContext->Path, "/", Path, NULL);
-	//printf("Path = %s\n", Path);
-	mkdir_p(concat(RootPath, Path, NULL));
-	const char *FileName = concat(RootPath, Path, "/", SystemName, NULL);
-	//printf("FileName = %s\n", FileName);
-	FileName = vfs_resolve(FileName);
-	target_t *ParentDefault = CurrentContext->Default;
-	context_t *Context = context_push(Path);
-	int Depends = 1;
+static ml_value_t *subdir_options(context_t *Context, int Count, ml_value_t **Args, int *Depends) {
 	for (int I = 1; I < Count; ++I) {
 		if (ml_is(Args[I], MLListT)) {
-			stringmap_t *Filter = Context->Filter = stringmap_new();
+			stringmap_t *Filter = Context->Filter ?: (Context->Filter = stringmap_new());
 			ML_LIST_FOREACH(Args[I], Iter) {
 				if (!ml_is(Iter->Value, MLStringT)) return ml_error("TypeError", "Expected string");
 				stringmap_insert(Filter, ml_string_value(Iter->Value), MLNil);
@@ -234,11 +228,26 @@ ML_FUNCTION(Subdir) {
 				context_symb_set(Context, ml_string_value(Iter->Key), Iter->Value);
 			}
 		} else if (Args[I] == MLNil) {
-			Depends = 0;
+			*Depends = 0;
 		}
 	}
-	if (Depends) targetset_insert(ParentDefault->Depends, CurrentContext->Default);
-	ml_value_t *Result = load_file(FileName);
+	return NULL;
+}
+
+static ml_value_t *subdir_load(const char *Path, const char *FileName, int Count, ml_value_t **Args, int Project) {
+	target_t *ParentDefault = CurrentContext->Default;
+	context_t *Context = context_push(Path);
+	if (Project) {
+		stringmap_t *Filter = Context->Filter = stringmap_new();
+		stringmap_insert(Filter, "ITERATION", MLNil);
+		context_symb_set(Context, "ROOT", (ml_value_t *)Context);
+	}
+	int Depends = 1;
+	ml_value_t *Result = subdir_options(Context, Count, Args, &Depends);
+	if (!Result) {
+		if (Depends) targetset_insert(ParentDefault->Depends, CurrentContext->Default);
+		Result = load_file(FileName);
+	}
 	context_pop();
 	if (ml_is_error(Result)) {
 		return Result;
@@ -247,6 +256,51 @@ ML_FUNCTION(Subdir) {
 	}
 }
 
+ML_FUNCTION(Subdir) {
+//<Name:string
+//>context|error
+// Creates a new directory subcontext with name :mini:`Name` and loads the :file:`build.rabs` file inside the directory.
+// Returns an error if the directory does not exist or does not contain a :file:`build.rabs` file.
+	ML_CHECK_ARG_COUNT(1);
+	ML_CHECK_ARG_TYPE(0, MLStringT);
+	const char *Path = ml_string_value(Args[0]);
+	Path = concat(CurrentContext->Path, "/", Path, NULL);
+	//printf("Path = %s\n", Path);
+	mkdir_p(concat(RootPath, Path, NULL));
+	const char *FileName = concat(RootPath, Path, "/", SystemName, NULL);
+	//printf("FileName = %s\n", FileName);
+	FileName = vfs_resolve(FileName);
+	return subdir_load(Path, FileName, Count, Args, 0);
+}
+
+static int is_root_file(const char *FileName) {
+	FILE *File = fopen(FileName, "r");
+	if (!File) return 0;
+	char Line[strlen(":< ROOT >:\n")];
+	int Root = fread(Line, 1, sizeof(Line), File) == sizeof(Line) && !memcmp(Line, ":< ROOT >:\n", sizeof(Line));
+	fclose(File);
+	return Root;
+}
+
+ML_FUNCTION(Subproject) {
+//<Path:string
+//>context|error
+// Loads the separate project in the directory :mini:`Path`, whose :file:`build.rabs` file must start with :mini:`:< ROOT >:`, into a new subcontext.
+// The subproject is built by the same threads and with the same build database as the enclosing project instead of by a nested :mini:`rabs` process.
+// Symbols from the enclosing contexts are hidden from the subproject, except :mini:`ITERATION`, and :mini:`ROOT` refers to the subproject's own context.
+// Additional arguments are handled as in :mini:`subdir()`: a map sets symbols in the new context, a list makes the named enclosing symbols visible and :mini:`nil` stops the enclosing :mini:`DEFAULT` from depending on the subproject.
+	ML_CHECK_ARG_COUNT(1);
+	ML_CHECK_ARG_TYPE(0, MLStringT);
+	const char *Path = ml_string_value(Args[0]);
+	Path = concat(CurrentContext->Path, "/", Path, NULL);
+	mkdir_p(concat(RootPath, Path, NULL));
+	const char *FileName = vfs_resolve(concat(RootPath, Path, "/", SystemName, NULL));
+	if (!is_root_file(FileName)) return ml_error("SubprojectError", "%s is not a project root", FileName);
+	// Targets of the subproject keep ids relative to RootPath and are recorded in the one cache, whose depends and scans
+	// sets refer to targets by cache index so dependencies between the projects could not be split across databases.
+	return subdir_load(Path, FileName, Count, Args, 1);
+}
+
 ML_FUNCTION(Scope) {
 //<Name:string
 //<Function:function
@@ -256,7 +310,10 @@ ML_FUNCTION(Scope) {
 	ML_CHECK_ARG_TYPE(0, MLStringT);
 	const char *Name = ml_string_value(Args[0]);
 	context_scope(Name);
+	target_t *OldSuspend = SuspendTarget;
+	SuspendTarget = NULL;
 	ml_value_t *Result = ml_simple_call(Args[1], 0, NULL);
+	SuspendTarget = OldSuspend;
 	context_pop();
 	return Result;
 }
@@ -379,33 +436,96 @@ ML_METHOD("append", MLStringBufferT, MLMapT) {
 
 static int ErrorLogFile = STDERR_FILENO;
 
-typedef struct command_output_t command_output_t;
+typedef struct {
+	const char *Command;
+	target_resume_t *Resume;
+	char *Chars;
+	size_t Length;
+	clock_t Start, End;
+	int Capture, Token, Error, Status;
+} command_t;
 
-struct command_output_t {
-	command_output_t *Next;
-	char Chars[ML_STRINGBUFFER_NODE_SIZE];
-};
+static ml_value_t *command_result(command_t *Command) {
+	ml_value_t *Result = MLNil;
+	if (Command->Error) {
+		Result = ml_error("WaitError", "error waiting for child process");
+		ml_error_trace_add(Result, (ml_source_t){Command->Command, 0});
+		return Result;
+	}
+	if (Command->Capture) Result = ml_string(Command->Chars, Command->Length);
+	if (EchoCommands) printf("\t\e[33m%f seconds.\e[0m\n", ((double)(Command->End - Command->Start)) / CLOCKS_PER_SEC);
+	int Status = Command->Status;
+	if (WIFEXITED(Status)) {
+		if (WEXITSTATUS(Status) != 0) {
+			Result = ml_error("ExecuteError", "process returned non-zero exit code");
+			ml_error_trace_add(Result, (ml_source_t){Command->Command, WEXITSTATUS(Status)});
+		}
+	} else {
+		Result = ml_error("ExecuteError", "process exited abnormally");
+		ml_error_trace_add(Result, (ml_source_t){Command->Command, 0});
+	}
+	return Result;
+}
 
-static ml_value_t *command(int Capture, int Count, ml_value_t **Args) {
-	ML_CHECK_ARG_COUNT(1);
+static void command_done(command_t *Command, int Error, int Status, char *Chars, size_t Length) {
+	// Called on the process reactor thread without InterpreterLock
+	jobserver_release(Command->Token);
+	Command->End = clock();
+	Command->Error = Error;
+	Command->Status = Status;
+	Command->Chars = Chars;
+	Command->Length = Length;
+	target_resume_later(Command->Resume);
+}
+
+static void command_resume(ml_state_t *Caller, target_t *Depend, ml_value_t **Args) {
+	ML_RETURN(command_result((command_t *)Args[0]));
+}
+
+static void command_wait(ml_state_t *Caller, command_t *Command, pid_t Child, int Output) {
+	if (target_suspendable()) {
+		// Suspend the calling build function instead of blocking this thread until the command exits
+		ml_value_t *ResumeArgs[1] = {(ml_value_t *)Command};
+		Command->Resume = target_suspend(Caller, command_resume, 1, ResumeArgs);
+		if (!process_wait_async(Child, Output, Command->Capture, (process_done_fn)command_done, Command)) return;
+		target_suspend_cancel(Command->Resume);
+	}
+	if (CurrentThread) CurrentThread->Child = Child;
+	pthread_mutex_unlock(InterpreterLock);
+	Command->Error = process_wait(Child, Output, Command->Capture, &Command->Chars, &Command->Length, &Command->Status);
+	jobserver_release(Command->Token);
+	Command->End = clock();
+	pthread_mutex_lock(InterpreterLock);
+	if (CurrentThread) CurrentThread->Child = 0;
+	ML_RETURN(command_result(Command));
+}
+
+static void command(ml_state_t *Caller, int Capture, int Count, ml_value_t **Args) {
+	ML_CHECKX_ARG_COUNT(1);
 	ml_stringbuffer_t Buffer[1] = {ML_STRINGBUFFER_INIT};
 	int Last = Buffer->Length;
 	for (int I = 0; I < Count; ++I) {
 		if (Buffer->Length > Last) ml_stringbuffer_put(Buffer, ' ');
 		Last = Buffer->Length;
 		ml_value_t *Result = ml_stringbuffer_simple_append(Buffer, Args[I]);
-		if (ml_is_error(Result)) return Result;
+		if (ml_is_error(Result)) ML_RETURN(Result);
 	}
-	const char *Command = ml_stringbuffer_get_string(Buffer);
-	if (EchoCommands) printf("\e[34m%s: %s\e[0m\n", CurrentDirectory, Command);
+	command_t *Command = new(command_t);
+	Command->Command = ml_stringbuffer_get_string(Buffer);
+	Command->Capture = Capture;
+	if (EchoCommands) printf("\e[34m%s: %s\e[0m\n", CurrentDirectory, Command->Command);
 	if (DebugThreads && CurrentThread) {
-		strncpy(CurrentThread->Command, Command, sizeof(CurrentThread->Command) - 1);
+		strncpy(CurrentThread->Command, Command->Command, sizeof(CurrentThread->Command) - 1);
 		display_threads();
 	}
-	clock_t Start = clock();
+	Command->Start = clock();
 	const char *WorkingDirectory = CurrentDirectory;
+	Command->Token = jobserver_acquire();
 	int Pipe[2];
-	if (pipe(Pipe) == -1) return ml_error("PipeError", "failed to create pipe");
+	if (pipe(Pipe) == -1) {
+		jobserver_release(Command->Token);
+		ML_RETURN(ml_error("PipeError", "failed to create pipe"));
+	}
 	pid_t Child = fork();
 	if (!Child) {
 		setpgid(0, 0);
@@ -413,83 +533,27 @@ static ml_value_t *command(int Capture, int Count, ml_value_t **Args) {
 		close(Pipe[0]);
 		dup2(Pipe[1], STDOUT_FILENO);
 		dup2(ErrorLogFile, STDERR_FILENO);
-		execl("/bin/sh", "sh", "-c", Command, NULL);
+		execl("/bin/sh", "sh", "-c", Command->Command, NULL);
 		exit(-1);
 	}
 	close(Pipe[1]);
-	ml_value_t *Result = MLNil;
-	if (CurrentThread) CurrentThread->Child = Child;
-	pthread_mutex_unlock(InterpreterLock);
-	if (Capture) {
-		size_t Total = 0;
-		command_output_t *Head = new(command_output_t), *Current = Head;
-		size_t Space = ML_STRINGBUFFER_NODE_SIZE;
-		char *Chars = Current->Chars;
-		for (;;) {
-			ssize_t Count = read(Pipe[0], Chars, Space);
-			if (Count <= 0) break;
-			if (Count > 0) {
-				Total += Count;
-				Space -= Count;
-				if (!Space) {
-					Current = Current->Next = new(command_output_t);
-					Space = ML_STRINGBUFFER_NODE_SIZE;
-					Chars = Current->Chars;
-				} else {
-					Chars += Count;
-				}
-			}
-		}
-		Chars = snew(Total + 1);
-		char *End = Chars;
-		for (command_output_t *Output = Head; Output != Current; Output = Output->Next) {
-			memcpy(End, Output->Chars, ML_STRINGBUFFER_NODE_SIZE);
-			End += ML_STRINGBUFFER_NODE_SIZE;
-		}
-		memcpy(End, Current->Chars, ML_STRINGBUFFER_NODE_SIZE - Space);
-		Chars[Total] = 0;
-		Result = ml_string(Chars, Total);
-	} else {
-		char Chars[ML_STRINGBUFFER_NODE_SIZE];
-		for (;;) {
-			ssize_t Count = read(Pipe[0], Chars, ML_STRINGBUFFER_NODE_SIZE);
-			if (Count <= 0) break;
-		}
-	}
-	close(Pipe[0]);
-	int Status;
-	if (waitpid(Child, &Status, 0) == -1) {
-		Result = ml_error("WaitError", "error waiting for child process");
-		ml_error_trace_add(Result, (ml_source_t){Command, 0});
-	}
-	clock_t End = clock();
-	pthread_mutex_lock(InterpreterLock);
-	if (CurrentThread) CurrentThread->Child = 0;
-	if (EchoCommands) printf("\t\e[33m%f seconds.\e[0m\n", ((double)(End - Start)) / CLOCKS_PER_SEC);
-	if (WIFEXITED(Status)) {
-		if (WEXITSTATUS(Status) != 0) {
-			Result = ml_error("ExecuteError", "process returned non-zero exit code");
-			ml_error_trace_add(Result, (ml_source_t){Command, WEXITSTATUS(Status)});
-		}
-	} else {
-		Result = ml_error("ExecuteError", "process exited abnormally");
-		ml_error_trace_add(Result, (ml_source_t){Command, 0});
-	}
-	return Result;
+	return command_wait(Caller, Command, Child, Pipe[0]);
 }
 
-ML_FUNCTION(Execute) {
+ML_FUNCTIONX(Execute) {
 //<Command..:any
 //>nil|error
 // Builds a shell command from :mini:`Command..` and executes it, discarding the output. Returns :mini:`nil` on success or raises an error.
-	return command(0, Count, Args);
+// The calling build function is suspended while the command runs so the thread can build other targets.
+	return command(Caller, 0, Count, Args);
 }
 
-ML_FUNCTION(Shell) {
+ML_FUNCTIONX(Shell) {
 //<Command..:any
 //>string|error
 // Builds a shell command from :mini:`Command..` and executes it, capturing the output. Returns the captured output on success or raises an error.
-	return command(1, Count, Args);
+// The calling build function is suspended while the command runs so the thread can build other targets.
+	return command(Caller, 1, Count, Args);
 }
 
 ML_METHOD(ArgifyMethod, MLListT, MLNilT) {
@@ -557,121 +621,70 @@ ML_METHOD(ArgifyMethod, MLListT, MLMapT) {
 
 #else
 
-ML_FUNCTION(Execv) {
-//<Command:list
-//>nil|error
-// Similar to :mini:`execute()` but expects a list of individual arguments instead of letting the shell split the command line.
-	ML_CHECK_ARG_COUNT(1);
+static void commandv(ml_state_t *Caller, int Capture, int Count, ml_value_t **Args) {
+	ML_CHECKX_ARG_COUNT(1);
 	ml_value_t *ArgList = ml_list();
 	for (int I = 0; I < Count; ++I) {
 		ml_value_t *Result = ml_simple_inline(ArgifyMethod, 2, ArgList, Args[I]);
-		if (ml_is_error(Result)) return Result;
+		if (ml_is_error(Result)) ML_RETURN(Result);
 	}
 	int Argc = ml_list_length(ArgList);
 	const char *Argv[Argc + 1];
 	const char **Argp = Argv;
+	ml_stringbuffer_t Buffer[1] = {ML_STRINGBUFFER_INIT};
 	ML_LIST_FOREACH(ArgList, Node) {
 		*Argp = ml_string_value(Node->Value);
+		if (Argp > Argv) ml_stringbuffer_put(Buffer, ' ');
+		ml_stringbuffer_write(Buffer, *Argp, ml_string_length(Node->Value));
 		++Argp;
 	}
 	*Argp = NULL;
+	command_t *Command = new(command_t);
+	Command->Command = ml_stringbuffer_get_string(Buffer);
+	Command->Capture = Capture;
 	const char *WorkingDirectory = CurrentDirectory;
-	if (EchoCommands) {
-		printf("\e[34m%s:", WorkingDirectory);
-		for (int I = 0; I < Argc; ++I) printf(" %s", Argv[I]);
-		printf("\e[0m\n");
+	if (EchoCommands) printf("\e[34m%s: %s\e[0m\n", WorkingDirectory, Command->Command);
+	if (DebugThreads && CurrentThread) {
+		strncpy(CurrentThread->Command, Command->Command, sizeof(CurrentThread->Command) - 1);
+		display_threads();
+	}
+	Command->Start = clock();
+	Command->Token = jobserver_acquire();
+	int Pipe[2] = {-1, -1};
+	if (Capture && pipe(Pipe) == -1) {
+		jobserver_release(Command->Token);
+		ML_RETURN(ml_error("PipeError", "failed to create pipe"));
 	}
-	clock_t Start = clock();
 	pid_t Child = fork();
 	if (!Child) {
+		setpgid(0, 0);
 		if (chdir(WorkingDirectory)) exit(-1);
-		int DevNull = open("/dev/null", O_WRONLY | O_CREAT, 0666);
-		dup2(DevNull, STDOUT_FILENO);
-		close(DevNull);
-		if (execvp(Argv[0], (char * const *)Argv) == -1) exit(-1);
-	}
-	pthread_mutex_unlock(InterpreterLock);
-	int Status;
-	if (waitpid(Child, &Status, 0) == -1) return ml_error("WaitError", "error waiting for child process");
-	pthread_mutex_lock(InterpreterLock);
-	if (EchoCommands) {
-		clock_t End = clock();
-		printf("\t\e[33m%f seconds.\e[0m\n", ((double)(End - Start)) / CLOCKS_PER_SEC);
-	}
-	if (WIFEXITED(Status)) {
-		if (WEXITSTATUS(Status) != 0) {
-			return ml_error("ExecuteError", "process returned non-zero exit code");
+		if (Capture) {
+			close(Pipe[0]);
+			dup2(Pipe[1], STDOUT_FILENO);
 		} else {
-			return MLNil;
+			int DevNull = open("/dev/null", O_WRONLY | O_CREAT, 0666);
+			dup2(DevNull, STDOUT_FILENO);
+			close(DevNull);
 		}
-	} else {
-		return ml_error("ExecuteError", "process exited abnormally");
+		if (execvp(Argv[0], (char * const *)Argv) == -1) exit(-1);
 	}
+	if (Capture) close(Pipe[1]);
+	return command_wait(Caller, Command, Child, Pipe[0]);
 }
 
-ML_FUNCTION(Shellv) {
+ML_FUNCTIONX(Execv) {
+//<Command:list
+//>nil|error
+// Similar to :mini:`execute()` but expects a list of individual arguments instead of letting the shell split the command line.
+	return commandv(Caller, 0, Count, Args);
+}
+
+ML_FUNCTIONX(Shellv) {
 //<Command:list
 //>nil|error
 // Similar to :mini:`shell()` but expects a list of individual arguments instead of letting the shell split the command line.
-	ML_CHECK_ARG_COUNT(1);
-	ml_value_t *ArgList = ml_list();
-	for (int I = 0; I < Count; ++I) {
-		ml_value_t *Result = ml_simple_inline(ArgifyMethod, 2, ArgList, Args[I]);
-		if (ml_is_error(Result)) return Result;
-	}
-	int Argc = ml_list_length(ArgList);
-	const char *Argv[Argc + 1];
-	const char **Argp = Argv;
-	ML_LIST_FOREACH(ArgList, Node) {
-		*Argp = ml_string_value(Node->Value);
-		++Argp;
-	}
-	*Argp = NULL;
-	const char *WorkingDirectory = CurrentDirectory;
-	if (EchoCommands) {
-		printf("\e[34m%s:", WorkingDirectory);
-		for (int I = 0; I < Argc; ++I) printf(" %s", Argv[I]);
-		printf("\e[0m\n");
-	}
-	clock_t Start = clock();
-	int Pipe[2];
-	if (pipe(Pipe) == -1) return ml_error("PipeError", "failed to create pipe");
-	pid_t Child = fork();
-	if (!Child) {
-		if (chdir(WorkingDirectory)) exit(-1);
-		close(Pipe[0]);
-		dup2(Pipe[1], STDOUT_FILENO);
-		if (execvp(Argv[0], (char * const *)Argv) == -1) exit(-1);
-	}
-	close(Pipe[1]);
-	ml_stringbuffer_t Buffer[1] = {ML_STRINGBUFFER_INIT};
-	pthread_mutex_unlock(InterpreterLock);
-	char Chars[ML_STRINGBUFFER_NODE_SIZE];
-	for (;;) {
-		ssize_t Size = read(Pipe[0], Chars, ML_STRINGBUFFER_NODE_SIZE);
-		if (Size <= 0) break;
-		//pthread_mutex_lock(GlobalLock);
-		if (Size > 0) ml_stringbuffer_write(Buffer, Chars, Size);
-		//pthread_mutex_unlock(GlobalLock);
-	}
-	int Status;
-	if (waitpid(Child, &Status, 0) == -1) return ml_error("WaitError", "error waiting for child process");
-	pthread_mutex_lock(InterpreterLock);
-	if (EchoCommands) {
-		clock_t End = clock();
-		printf("\t\e[33m%f seconds.\e[0m\n", ((double)(End - Start)) / CLOCKS_PER_SEC);
-	}
-	if (WIFEXITED(Status)) {
-		if (WEXITSTATUS(Status) != 0) {
-			return ml_error("ExecuteError", "process returned non-zero exit code");
-		} else {
-			size_t Length = Buffer->Length;
-			ml_value_t *Result = ml_string(ml_stringbuffer_get_string(Buffer), Length);
-			return Result;
-		}
-	} else {
-		return ml_error("ExecuteError", "process exited abnormally");
-	}
+	return commandv(Caller, 1, Count, Args);
 }
 #endif
 
@@ -833,17 +846,17 @@ ML_FUNCTION(Defined) {
 	return stringmap_search(Defines, Key) ?: MLNil;
 }
 
-static int target_depends_auto_single(ml_value_t *Arg, void *Data) {
+static int target_depends_auto_single(ml_value_t *Arg, targetset_t *Depends) {
 	if (ml_is(Arg, MLListT)) {
 		ML_LIST_FOREACH(Arg, Iter) {
-			if (target_depends_auto_single(Iter->Value, NULL)) return 1;
+			if (target_depends_auto_single(Iter->Value, Depends)) return 1;
 		}
 	} else if (ml_is(Arg, MLStringT)) {
 		target_t *Depend = target_symb_new(CurrentContext, ml_string_value(Arg));
-		target_depends_auto(Depend);
+		if (Depend != CurrentTarget) targetset_insert(Depends, Depend);
 		return 0;
 	} else if (ml_is(Arg, TargetT)) {
-		target_depends_auto((target_t *)Arg);
+		if ((target_t *)Arg != CurrentTarget) targetset_insert(Depends, (target_t *)Arg);
 		return 0;
 	} else if (Arg == MLNil) {
 		return 0;
@@ -851,12 +864,14 @@ static int target_depends_auto_single(ml_value_t *Arg, void *Data) {
 	return 1;
 }
 
-ML_FUNCTION(Check) {
+ML_FUNCTIONX(Check) {
 //<Target..:target
 //>nil
 // Checks that each :mini:`Target` is up to date, building if necessary.
-	for (int I = 0; I < Count; ++I) target_depends_auto_single(Args[I], NULL);
-	return MLNil;
+// The calling build function is suspended while waiting so the thread can build other targets.
+	targetset_t *Depends = targetset_new();
+	for (int I = 0; I < Count; ++I) target_depends_auto_single(Args[I], Depends);
+	return target_depends_auto_allx(Caller, Depends);
 }
 
 /*static ml_value_t *type(void *Data, int Count, ml_value_t **Args) {
@@ -906,6 +921,7 @@ int main(int Argc, char **Argv) {
 	CurrentDirectory = "<random>";
 	SavedArgc = Argc;
 	SavedArgv = Argv;
+	GC_set_handle_fork(1);
 	GC_INIT();
 	ml_init(Argv[0], Globals);
 	ml_object_init(Globals);
@@ -918,6 +934,7 @@ int main(int Argc, char **Argv) {
 	ml_uuid_init(Globals);
 	stringmap_insert(Globals, "vmount", Vmount);
 	stringmap_insert(Globals, "subdir", Subdir);
+	stringmap_insert(Globals, "subproject", Subproject);
 	stringmap_insert(Globals, "target", Target);
 	stringmap_insert(Globals, "file", FileT);
 	stringmap_insert(Globals, "meta", MetaT);
@@ -925,12 +942,15 @@ int main(int Argc, char **Argv) {
 	// TODO: add functions to register and create udf targets
 	stringmap_insert(Globals, "symbol", SymbolT);
 	stringmap_insert(Globals, "scan", ScanT);
+	stringmap_insert(Globals, "pool", TargetPoolT);
+	stringmap_insert(Globals, "batch", TargetBatchT);
 	stringmap_insert(Globals, "include", Include);
 	stringmap_insert(Globals, "context", ContextT);
 	stringmap_insert(Globals, "execute", Execute);
 	stringmap_insert(Globals, "shell", Shell);
 	stringmap_insert(Globals, "execv", Execv);
 	stringmap_insert(Globals, "shellv", Shellv);
+	stringmap_insert(Globals, "worker", WorkerT);
 	stringmap_insert(Globals, "mkdir", Mkdir);
 	stringmap_insert(Globals, "chdir", Chdir);
 	stringmap_insert(Globals, "scope", Scope);
@@ -950,6 +970,7 @@ int main(int Argc, char **Argv) {
 	target_init();
 	context_init();
 	library_init();
+	worker_init();
 
 	struct sigaction Action[1];
 	memset(Action, 0, sizeof(struct sigaction));
@@ -958,8 +979,10 @@ int main(int Argc, char **Argv) {
 
 
 	target_arg_t *TargetArgs = NULL;
-	int NumThreads = 1;
+	int NumThreads = 1, AdaptiveThreads = 0;
+	int NumHashThreads = -1;
 	int InteractiveMode = 0;
+	const char *SimulateTrace = NULL;
 	for (int I = 1; I < Argc; ++I) {
 		if (Argv[I][0] == '-') {
 			switch (Argv[I][1]) {
@@ -1004,10 +1027,37 @@ int main(int Argc, char **Argv) {
 				break;
 			}
 			case 'p': {
+				const char *Count = Argv[I][2] ? Argv[I] + 2 : Argv[++I];
+				if (!Count) {
+					fprintf(stderr, "\e[31mError: -p requires a thread count, auto or adaptive\e[0m\n");
+					exit(1);
+				} else if (!strcmp(Count, "auto")) {
+					NumThreads = cpuinfo_count();
+				} else if (!strcmp(Count, "adaptive")) {
+					NumThreads = cpuinfo_count();
+					AdaptiveThreads = 1;
+				} else {
+					NumThreads = atoi(Count);
+				}
+				break;
+			}
+			case 'j': {
 				if (Argv[I][2]) {
-					NumThreads = atoi(Argv[I] + 2);
+					NumHashThreads = atoi(Argv[I] + 2);
 				} else {
-					NumThreads = atoi(Argv[++I]);
+					NumHashThreads = atoi(Argv[++I]);
+				}
+				break;
+			}
+			case 'k': {
+				KeepGoing = 1;
+				break;
+			}
+			case 'l': {
+				if (Argv[I][2]) {
+					MaxLoad = atof(Argv[I] + 2);
+				} else {
+					MaxLoad = atof(Argv[++I]);
 				}
 				break;
 			}
@@ -1045,6 +1095,31 @@ int main(int Argc, char **Argv) {
 				break;
 			}
 			case '-': {
+				if (!strcmp(Argv[I], "--mem-reserve")) {
+					if (I + 1 >= Argc) {
+						fprintf(stderr, "\e[31mError: --mem-reserve requires a size in bytes\e[0m\n");
+						exit(1);
+					}
+					MemoryReserve = atol(Argv[++I]);
+				} else if (!strncmp(Argv[I], "--mem-reserve=", strlen("--mem-reserve="))) {
+					MemoryReserve = atol(Argv[I] + strlen("--mem-reserve="));
+				} else if (!strcmp(Argv[I], "--trace") || !strncmp(Argv[I], "--trace=", strlen("--trace="))) {
+					if (!Argv[I][strlen("--trace")] && I + 1 >= Argc) {
+						fprintf(stderr, "\e[31mError: --trace requires a file name\e[0m\n");
+						exit(1);
+					}
+					const char *FileName = Argv[I][strlen("--trace")] ? Argv[I] + strlen("--trace=") : Argv[++I];
+					if (!(BuildTrace = fopen(FileName, "w"))) {
+						fprintf(stderr, "\e[31mError: could not open trace file\e[0m\n");
+						exit(1);
+					}
+				} else if (!strcmp(Argv[I], "--simulate") || !strncmp(Argv[I], "--simulate=", strlen("--simulate="))) {
+					if (!Argv[I][strlen("--simulate")] && I + 1 >= Argc) {
+						fprintf(stderr, "\e[31mError: --simulate requires a trace file name\e[0m\n");
+						exit(1);
+					}
+					SimulateTrace = Argv[I][strlen("--simulate")] ? Argv[I] + strlen("--simulate=") : Argv[++I];
+				}
 				break;
 			}
 			case 'h': default: {
@@ -1054,8 +1129,14 @@ int main(int Argc, char **Argv) {
 				puts("    -Dkey[=value]   add a define");
 				puts("    -c              print shell commands");
 				puts("    -s              print each target after building");
-				puts("    -p n            run n threads");
+				puts("    -p n            run n threads (auto for one per available cpu, adaptive to adjust with cpu usage)");
+				puts("    -j n            run n file hashing threads (defaults to -p)");
+				puts("    -k              keep building independent targets after a build function fails");
+				puts("    -l load         do not start new builds while the load average is above load");
+				puts("    --mem-reserve n do not start new builds while less than n MB of memory is available");
 				puts("    -G              generate dependencies.dot");
+				puts("    --trace file    record the targets checked, their durations and dependencies to file");
+				puts("    --simulate file replay a recorded trace with -p threads and report the makespan, utilisation and critical path");
 #ifdef Linux
 				puts("    -w              watch for file changes [experimental]");
 #endif
@@ -1070,6 +1151,8 @@ int main(int Argc, char **Argv) {
 		}
 	}
 
+	if (SimulateTrace) exit(simulate_trace(SimulateTrace, NumThreads));
+
 	const char *Path = getcwd(NULL, 0);
 	CurrentDirectory = Path;
 	RootPath = find_root(Path);
@@ -1099,9 +1182,19 @@ int main(int Argc, char **Argv) {
 	CurrentThread = new(build_thread_t);
 	CurrentThread->Id = 0;
 	CurrentThread->Status = BUILD_IDLE;
-	if (!InteractiveMode) target_threads_start(NumThreads);
+	process_init();
+	// Adaptive mode resizes the jobserver along with the threads, commands are suspended so the slots bound their concurrency
+	jobserver_init(NumThreads);
+	DefaultWorkerLimit = NumThreads;
+	targethash_init(NumHashThreads < 0 ? NumThreads : NumHashThreads);
+	if (!InteractiveMode) {
+		target_threads_start(NumThreads);
+		if (AdaptiveThreads) target_threads_adapt(NumThreads, 2 * NumThreads);
+	}
 
+	target_file_prefetch_cached_start();
 	ml_value_t *Result = load_file(concat(RootPath, "/", SystemName, NULL));
+	target_file_prefetch_cached_stop();
 	if (ml_is_error(Result)) {
 		printf("\e[31mError: %s\n\e[0m", ml_error_message(Result));
 		ml_source_t Source;
@@ -1138,10 +1231,13 @@ int main(int Argc, char **Argv) {
 		target_queue(Arg->Target, NULL);
 	}
 	target_threads_wait();
+	if (StatusUpdates) printf("\e[35mComputed priorities in %.3fs\e[0m\n", PriorityTime);
 	if (DependencyGraph) {
 		fprintf(DependencyGraph, "}");
 		fclose(DependencyGraph);
 	}
+	if (BuildTrace) fclose(BuildTrace);
+	if (target_failures_report() && !InteractiveMode && !WatchMode) exit(1);
 	if (InteractiveMode) {
 		target_interactive_start(NumThreads);
 		ml_console(MLRootContext, rabs_ml_global, Globals, "--> ", "... ");
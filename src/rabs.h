@@ -15,6 +15,7 @@ typedef struct build_thread_t build_thread_t;
 struct build_thread_t {
 	build_thread_t *Next;
 	target_t *Target;
+	struct targetqueue_t *Queue;
 	pthread_t Handle;
 	int Id;
 	pid_t Child;
@@ -26,11 +27,13 @@ extern const char *RootPath, *SystemName;
 extern __thread const char *CurrentDirectory;
 extern __thread build_thread_t *CurrentThread;
 extern __thread target_t *CurrentTarget;
+// Target whose build function can be suspended from the current call, cleared while running code inline.
+extern __thread target_t *SuspendTarget;
 
 ml_value_t *rabs_global(const char *Name);
 ml_value_t *rabs_ml_global(void *Data, const char *Name, const char *Source, int Line, int Mode);
 
-#define CURRENT_VERSION 2, 38, 4
+#define CURRENT_VERSION 2, 39, 0
 #define MINIMAL_VERSION 2, 38, 1
 
 #endif
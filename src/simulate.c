@@ -0,0 +1,233 @@
+#include "simulate.h"
+#include "target.h"
+#include "targetqueue.h"
+#include "targetpool.h"
+#include "rabs.h"
+#include "stringmap.h"
+#include "ml_macros.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gc/gc.h>
+
+// Replays a build trace recorded with --trace through the real ready queues, priorities and pools using a simulated clock.
+// Each trace line is: duration (ms), has build function, weight, pool limit, pool name, target id, dependency ids (tab separated).
+
+#define CRITICAL_PATH_SHOWN 20
+
+typedef struct simulate_target_t simulate_target_t;
+
+struct simulate_target_t {
+	target_t Base;
+	simulate_target_t *Critical;
+	long Longest;
+	int Build, Seen;
+};
+
+static stringmap_t Targets[1] = {STRINGMAP_INIT};
+static stringmap_t Pools[1] = {STRINGMAP_INIT};
+static int NumTargets = 0;
+
+static simulate_target_t *simulate_target(const char *Id) {
+	simulate_target_t *Target = stringmap_search(Targets, Id);
+	if (Target) return Target;
+	// Ids point into the line buffer, which is reused, so the map key must be a copy.
+	Id = GC_strdup(Id);
+	Target = new(simulate_target_t);
+	Target->Base.Id = Id;
+	Target->Base.IdLength = strlen(Id);
+	Target->Base.QueueIndex = -1;
+	Target->Base.QueuePriority = PRIORITY_INVALID;
+	Target->Base.Affects->Type = TargetSetT;
+	Target->Base.Depends->Type = TargetSetT;
+	Target->Base.BuildDepends->Type = TargetSetT;
+	stringmap_insert(Targets, Id, Target);
+	++NumTargets;
+	return Target;
+}
+
+static targetpool_t *simulate_pool(const char *Name, int Limit) {
+	targetpool_t *Pool = stringmap_search(Pools, Name);
+	if (Pool) return Pool;
+	Name = GC_strdup(Name);
+	Pool = new(targetpool_t);
+	Pool->Type = TargetPoolT;
+	Pool->Name = Name;
+	Pool->DeferredTail = &Pool->Deferred;
+	Pool->Limit = Limit;
+	pthread_cond_init(Pool->Available, NULL);
+	stringmap_insert(Pools, Name, Pool);
+	return Pool;
+}
+
+static char *simulate_unescape(char *String) {
+	// Reverses the escaping of tabs, newlines and backslashes done by target_trace.
+	char *Out = String;
+	for (const char *In = String; *In; ++In) {
+		if (In[0] != '\\' || !In[1]) {
+			*Out++ = *In;
+			continue;
+		}
+		switch (*++In) {
+		case 't': *Out++ = '\t'; break;
+		case 'n': *Out++ = '\n'; break;
+		default: *Out++ = *In; break;
+		}
+	}
+	*Out = 0;
+	return String;
+}
+
+static int simulate_load(const char *FileName) {
+	FILE *File = fopen(FileName, "r");
+	if (!File) {
+		fprintf(stderr, "\e[31mError: could not open %s\e[0m\n", FileName);
+		return 1;
+	}
+	char *Line = NULL;
+	size_t Size = 0;
+	ssize_t Length;
+	int LineNo = 0;
+	while ((Length = getline(&Line, &Size, File)) > 0) {
+		++LineNo;
+		if (Line[Length - 1] == '\n') Line[--Length] = 0;
+		if (!Length) continue;
+		char *Fields[5];
+		char *Next = Line;
+		for (int I = 0; I < 5; ++I) {
+			Fields[I] = strsep(&Next, "\t");
+			if (!Next) {
+				fprintf(stderr, "\e[31mError: %s:%d: invalid trace line\e[0m\n", FileName, LineNo);
+				fclose(File);
+				free(Line);
+				return 1;
+			}
+		}
+		simulate_target_t *Target = simulate_target(simulate_unescape(strsep(&Next, "\t")));
+		Target->Seen = 1;
+		Target->Build = atoi(Fields[1]);
+		Target->Base.Duration = Target->Build ? atoi(Fields[0]) : 0;
+		Target->Base.Weight = atoi(Fields[2]);
+		if (Target->Build && Fields[4][0]) Target->Base.Pool = simulate_pool(simulate_unescape(Fields[4]), atoi(Fields[3]));
+		while (Next) {
+			simulate_target_t *Depend = simulate_target(simulate_unescape(strsep(&Next, "\t")));
+			if (Depend != Target && targetset_insert(Target->Base.Depends, (target_t *)Depend)) {
+				targetset_insert(Depend->Base.Affects, (target_t *)Target);
+				++Target->Base.WaitCount;
+			}
+		}
+	}
+	free(Line);
+	fclose(File);
+	return 0;
+}
+
+static target_t *simulate_next() {
+	for (;;) {
+		target_t *Target = targetqueue_next();
+		if (!Target) return NULL;
+		if (targetpool_defer(Target)) continue;
+		if (Target->Pool) ++Target->Pool->Running;
+		return Target;
+	}
+}
+
+static int simulate_longest(simulate_target_t *Depend, simulate_target_t *Target) {
+	if (!Target->Critical || Depend->Longest > Target->Critical->Longest) Target->Critical = Depend;
+	return 0;
+}
+
+static int simulate_affect(target_t *Target, void *Data) {
+	if (--Target->WaitCount == 0) targetqueue_insert(Target);
+	return 0;
+}
+
+static void simulate_complete(simulate_target_t *Target) {
+	targetset_foreach(Target->Base.Depends, Target, (void *)simulate_longest);
+	Target->Longest = Target->Base.Duration + (Target->Critical ? Target->Critical->Longest : 0);
+	targetpool_t *Pool = Target->Base.Pool;
+	if (Pool) {
+		target_t *Deferred = targetpool_release(Pool);
+		if (Deferred) targetqueue_insert(Deferred);
+	}
+	targetset_foreach(Target->Base.Affects, NULL, simulate_affect);
+}
+
+typedef struct {
+	target_t **Ready;
+	int Count, Missing;
+	simulate_target_t *Longest;
+} simulate_start_t;
+
+static int simulate_ready(const char *Id, simulate_target_t *Target, simulate_start_t *Start) {
+	if (!Target->Seen) ++Start->Missing;
+	if (!Target->Base.WaitCount) Start->Ready[Start->Count++] = (target_t *)Target;
+	return 0;
+}
+
+static int simulate_critical(const char *Id, simulate_target_t *Target, simulate_start_t *Start) {
+	if (!Start->Longest || Target->Longest > Start->Longest->Longest) Start->Longest = Target;
+	return 0;
+}
+
+int simulate_trace(const char *FileName, int NumThreads) {
+	if (simulate_load(FileName)) return 1;
+	if (NumThreads < 1) NumThreads = 1;
+	build_thread_t *Threads = anew(build_thread_t, NumThreads);
+	simulate_target_t **Running = anew(simulate_target_t *, NumThreads);
+	long *Finish = anew(long, NumThreads);
+	for (int I = 0; I < NumThreads; ++I) {
+		Threads[I].Id = I;
+		Threads[I].Queue = targetqueue_new();
+	}
+	simulate_start_t Start[1] = {{anew(target_t *, NumTargets), 0, 0, NULL}};
+	stringmap_foreach(Targets, Start, (void *)simulate_ready);
+	CurrentThread = NULL;
+	targetqueue_insert_all(Start->Ready, Start->Count);
+	long Clock = 0, Work = 0;
+	int Remaining = NumTargets, Built = 0;
+	while (Remaining) {
+		for (int I = 0; I < NumThreads; ++I) {
+			if (Running[I]) continue;
+			CurrentThread = Threads + I;
+			simulate_target_t *Target = (simulate_target_t *)simulate_next();
+			if (!Target) break;
+			Running[I] = Target;
+			Finish[I] = Clock + Target->Base.Duration;
+			Work += Target->Base.Duration;
+			Built += Target->Build;
+		}
+		int Next = -1;
+		for (int I = 0; I < NumThreads; ++I) {
+			if (Running[I] && (Next < 0 || Finish[I] < Finish[Next])) Next = I;
+		}
+		if (Next < 0) {
+			fprintf(stderr, "\e[31mError: %d targets can never be built, the trace has a cycle\e[0m\n", Remaining);
+			CurrentThread = NULL;
+			return 1;
+		}
+		Clock = Finish[Next];
+		CurrentThread = Threads + Next;
+		simulate_complete(Running[Next]);
+		Running[Next] = NULL;
+		--Remaining;
+	}
+	CurrentThread = NULL;
+	stringmap_foreach(Targets, Start, (void *)simulate_critical);
+	printf("Simulated %d targets (%d with build functions) on %d threads\n", NumTargets, Built, NumThreads);
+	if (Start->Missing) printf("\e[33mWarning: %d dependencies were not recorded in the trace and take no time\e[0m\n", Start->Missing);
+	printf("Makespan:      %.3fs\n", Clock / 1000.0);
+	printf("Total work:    %.3fs\n", Work / 1000.0);
+	printf("Utilisation:   %.1f%%\n", Clock ? (100.0 * Work) / ((double)Clock * NumThreads) : 100.0);
+	if (!Start->Longest) return 0;
+	int Length = 0;
+	for (simulate_target_t *Target = Start->Longest; Target; Target = Target->Critical) ++Length;
+	printf("Critical path: %.3fs through %d targets (makespan lower bound)\n", Start->Longest->Longest / 1000.0, Length);
+	int Shown = 0;
+	for (simulate_target_t *Target = Start->Longest; Target && Shown < CRITICAL_PATH_SHOWN; Target = Target->Critical) {
+		if (!Target->Build) continue;
+		printf("\t%8.3fs %s\n", Target->Base.Duration / 1000.0, Target->Base.Id);
+		++Shown;
+	}
+	return 0;
+}
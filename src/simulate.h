@@ -0,0 +1,6 @@
+#ifndef SIMULATE_H
+#define SIMULATE_H
+
+int simulate_trace(const char *FileName, int NumThreads);
+
+#endif
@@ -9,7 +9,14 @@
 #include "context.h"
 #include "targetcache.h"
 #include "targetqueue.h"
+#include "targetpool.h"
+#include "targetbatch.h"
+#include "worker.h"
 #include "cache.h"
+#include "process.h"
+#include "jobserver.h"
+#include "targethash.h"
+#include "cpuinfo.h"
 #include <string.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -52,11 +59,42 @@ int ProgressBar = 0;
 int MonitorFiles = 0;
 int DebugThreads = 0;
 int WatchMode = 0;
+int KeepGoing = 0;
+double MaxLoad = 0;
+long MemoryReserve = 0;
 FILE *DependencyGraph = NULL;
+FILE *BuildTrace = NULL;
 
 pthread_mutex_t InterpreterLock[1] = {PTHREAD_MUTEX_INITIALIZER};
 static pthread_cond_t TargetAvailable[1] = {PTHREAD_COND_INITIALIZER};
-static pthread_cond_t TargetUpdated[1] = {PTHREAD_COND_INITIALIZER};
+
+typedef struct target_waiter_t target_waiter_t;
+typedef struct target_waitgroup_t target_waitgroup_t;
+
+struct target_waitgroup_t {
+	pthread_cond_t Ready[1];
+	int Pending;
+};
+
+struct target_waiter_t {
+	target_waiter_t *Next;
+	target_waitgroup_t *Group;
+	target_resume_t *Resume;
+};
+
+struct target_resume_t {
+	target_resume_t *Next;
+	ml_state_t *Caller;
+	target_t *Depend, *Waiter;
+	context_t *Context;
+	const char *Directory;
+	target_value_fn Value;
+	ml_value_t **Args;
+	// Set if Waiter is a build function, which counts in RunningBuilds once resumed
+	int Building;
+};
+
+static target_resume_t *ResumeHead = NULL, **ResumeTail = &ResumeHead;
 
 ML_TYPE(TargetT, (MLAnyT), "target");
 // Base type for all targets.
@@ -67,6 +105,7 @@ ML_METHOD_DECL(Missing, "missing");
 __thread target_t *CurrentTarget = NULL;
 __thread context_t *CurrentContext = NULL;
 __thread const char *CurrentDirectory = NULL;
+__thread target_t *SuspendTarget = NULL;
 
 static int QueuedTargets = 0, BuiltTargets = 0, NumTargets = 0;
 
@@ -74,7 +113,85 @@ static int target_missing(target_t *Target, int LastChecked);
 
 static build_thread_t *BuildThreads = NULL;
 __thread build_thread_t *CurrentThread = NULL;
-static int RunningThreads = 0, LastThread = 0;
+static int RunningThreads = 0, LastThread = 0, RunningBuilds = 0;
+
+// Build threads blocked waiting for a target are compensated for by unparking or spawning spare threads,
+// so that MaxThreads threads are available for work. Extra threads park again once the waits finish.
+static pthread_cond_t SpareAvailable[1] = {PTHREAD_COND_INITIALIZER};
+static int MaxThreads = 0, ActiveThreads = 0, BlockedThreads = 0, ParkedThreads = 0, SpareTokens = 0, ThreadsFinished = 0;
+
+// Build functions suspended on something other than a target (e.g. a running command), resumed with target_resume_later().
+static int SuspendedBuilds = 0;
+
+static void target_thread_spawn(void);
+
+// Targets that become ready while the queue is being filled are collected and inserted in one go once the outermost
+// batch ends, waking at most one idle thread for each. Nothing inside a batch releases InterpreterLock.
+static target_t **ReadyTargets = NULL;
+static int ReadyCount = 0, ReadySize = 0, ReadyDepth = 0, IdleThreads = 0;
+
+static void target_wake_threads(int Count) {
+	if (Count >= IdleThreads) {
+		if (IdleThreads) pthread_cond_broadcast(TargetAvailable);
+	} else {
+		while (--Count >= 0) pthread_cond_signal(TargetAvailable);
+	}
+}
+
+static void target_ready(target_t *Target) {
+	if (!ReadyDepth) {
+		targetqueue_insert(Target);
+		return target_wake_threads(1);
+	}
+	if (ReadyCount == ReadySize) {
+		ReadySize = ReadySize ? 2 * ReadySize : 64;
+		target_t **NewTargets = anew(target_t *, ReadySize);
+		if (ReadyTargets) memcpy(NewTargets, ReadyTargets, ReadyCount * sizeof(target_t *));
+		ReadyTargets = NewTargets;
+	}
+	ReadyTargets[ReadyCount++] = Target;
+}
+
+static inline void target_ready_begin(void) {
+	++ReadyDepth;
+}
+
+// Waiting threads update queued targets inline to dispatch their dependencies, which nests target_update calls.
+// Past MAX_UPDATE_DEPTH the thread waits instead and leaves the target to the queue, so long chains do not exhaust the thread stack.
+#define MAX_UPDATE_DEPTH 64
+
+static __thread int UpdateDepth = 0;
+
+// Build function currently executing on this thread and counted in RunningBuilds. Builds waiting for other targets,
+// whether blocked, updating them inline or suspended, are not counted so that target_admit() never waits on them.
+static __thread target_t *BuildingTarget = NULL;
+
+typedef struct {
+	target_t *Target;
+	int Index;
+} queue_frame_t;
+
+static queue_frame_t *QueueStack = NULL;
+static int QueueStackSize = 0;
+
+static void target_ready_end(void) {
+	if (--ReadyDepth) return;
+	int Count = ReadyCount;
+	ReadyCount = 0;
+	targetqueue_insert_all(ReadyTargets, Count);
+	memset(ReadyTargets, 0, Count * sizeof(target_t *));
+	target_wake_threads(Count);
+}
+
+// Set in a forked build worker, which has a private copy of the target graph. Waiting for a target that is not yet
+// done asks the parent to build it, since only the parent can.
+static target_t *ForkTarget = NULL;
+static int ForkPipe = -1, ForkReply = -1;
+
+static void target_fork_wait(target_t *Depend);
+static int target_fork_pending(target_t *Depend, targetset_t *Pending);
+static void target_fork_request(targetset_t *Pending);
+static void target_fork_fail(void);
 
 void target_depends_auto(target_t *Depend) {
 	if (CurrentTarget && CurrentTarget != Depend) {
@@ -84,6 +201,7 @@ void target_depends_auto(target_t *Depend) {
 	}
 }
 
+
 target_t *target_alloc(int Size, ml_type_t *Type, const char *Id, size_t Index, target_t **Slot) {
 	++NumTargets;
 	target_t *Target = (target_t *)GC_MALLOC(Size);
@@ -96,6 +214,7 @@ target_t *target_alloc(int Size, ml_type_t *Type, const char *Id, size_t Index,
 	Target->LastUpdated = STATE_UNCHECKED;
 	Target->QueueIndex = -1;
 	Target->QueuePriority = PRIORITY_INVALID;
+	Target->Duration = -1;
 	Target->Depends->Type = TargetSetT;
 	Target->Affects->Type = TargetSetT;
 	Target->CacheIndex = Index;
@@ -134,6 +253,7 @@ ML_METHODV("[]", TargetT, MLAnyT) {
 	target_t *Target = (target_t *)Args[0];
 	if ((Count > 1) && (Args[Count - 1] != MLNil) && ml_is(Args[Count - 1], MLFunctionT)) {
 		Target->Build = Args[Count - 1];
+		Target->Batch = NULL;
 		Target->BuildContext = CurrentContext;
 		if (CurrentTarget) {
 			Target->Parent = CurrentTarget;
@@ -202,6 +322,7 @@ ML_METHOD("=>", TargetT, MLAnyT) {
 // Sets the build function for :mini:`Target` to :mini:`Function` and returns :mini:`Target`. The current context is also captured.
 	target_t *Target = (target_t *)Args[0];
 	Target->Build = Args[1];
+	Target->Batch = NULL;
 	Target->BuildContext = CurrentContext;
 	if (CurrentTarget) {
 		Target->Parent = CurrentTarget;
@@ -219,6 +340,7 @@ ML_METHOD("build", TargetT, MLAnyT) {
 // Sets the build function for :mini:`Target` to :mini:`Function` and returns :mini:`Target`. The current context is also captured.
 	target_t *Target = (target_t *)Args[0];
 	Target->Build = Args[1];
+	Target->Batch = NULL;
 	Target->BuildContext = CurrentContext;
 	if (CurrentTarget) {
 		Target->Parent = CurrentTarget;
@@ -253,6 +375,117 @@ ML_METHOD("affects", TargetT) {
 	return (ml_value_t *)Target->Affects;
 }
 
+ML_METHOD("pool", TargetT) {
+//<Target
+//>pool|nil
+// Returns the pool of :mini:`Target` if one has been set, otherwise returns :mini:`nil`.
+	target_t *Target = (target_t *)Args[0];
+	return (ml_value_t *)Target->Pool ?: MLNil;
+}
+
+ML_METHOD("pool", TargetT, TargetPoolT) {
+//<Target
+//<Pool
+//>target
+// Sets the pool for :mini:`Target` to :mini:`Pool` and returns :mini:`Target`. The build function of :mini:`Target` will only run while :mini:`Pool` has a free slot.
+	target_t *Target = (target_t *)Args[0];
+	Target->Pool = (targetpool_t *)Args[1];
+	return Args[0];
+}
+
+ML_METHOD("pool", TargetT, MLNilT) {
+//<Target
+//<Nil
+//>target
+// Removes :mini:`Target` from its pool and returns :mini:`Target`.
+	target_t *Target = (target_t *)Args[0];
+	Target->Pool = NULL;
+	return Args[0];
+}
+
+ML_METHOD("batch", TargetT) {
+//<Target
+//>batch|nil
+// Returns the batch of :mini:`Target` if one has been set, otherwise returns :mini:`nil`.
+	target_t *Target = (target_t *)Args[0];
+	return (ml_value_t *)Target->Batch ?: MLNil;
+}
+
+ML_METHOD("batch", TargetT, TargetBatchT) {
+//<Target
+//<Batch
+//>target
+// Adds :mini:`Target` to :mini:`Batch` and returns :mini:`Target`. The function of :mini:`Batch` becomes the build function of :mini:`Target` and is called with a list of targets to build instead of a single target.
+	target_t *Target = (target_t *)Args[0];
+	targetbatch_t *Batch = (targetbatch_t *)Args[1];
+	Target->Batch = Batch;
+	Target->Build = Batch->Function;
+	Target->BuildContext = CurrentContext;
+	if (CurrentTarget) {
+		Target->Parent = CurrentTarget;
+		if (DependencyGraph) {
+			fprintf(DependencyGraph, "\tT%" PRIxPTR " -> T%" PRIxPTR " [color=red];\n", (uintptr_t)Target, (uintptr_t)Target->Parent);
+		}
+	}
+	return Args[0];
+}
+
+ML_METHOD("batch", TargetT, MLNilT) {
+//<Target
+//<Nil
+//>target
+// Removes :mini:`Target` from its batch and its build function, and returns :mini:`Target`.
+	target_t *Target = (target_t *)Args[0];
+	if (Target->Batch) {
+		Target->Batch = NULL;
+		Target->Build = NULL;
+	}
+	return Args[0];
+}
+
+ML_METHOD("fork", TargetT) {
+//<Target
+//>boolean
+// Returns :mini:`true` if the build function of :mini:`Target` runs in a forked worker process.
+	target_t *Target = (target_t *)Args[0];
+	return Target->Fork ? MLTrue : MLFalse;
+}
+
+ML_METHOD("fork", TargetT, MLBooleanT) {
+//<Target
+//<Fork
+//>target
+// Sets whether the build function of :mini:`Target` runs in a forked worker process and returns :mini:`Target`.
+// A forked build function does not hold the interpreter lock of the main process, so CPU heavy Minilang code can run in parallel with other builds.
+// Targets defined or modified inside a forked build function are not visible to the main process, only the ids of its dependencies and its result are sent back.
+// Targets the forked build function waits for that are not yet built are built by the main process while the worker waits.
+	target_t *Target = (target_t *)Args[0];
+	Target->Fork = Args[1] == MLTrue;
+	return Args[0];
+}
+
+ML_METHOD("weight", TargetT) {
+//<Target
+//>integer
+// Returns the scheduling weight of :mini:`Target`.
+	target_t *Target = (target_t *)Args[0];
+	return ml_integer(Target->Weight);
+}
+
+ML_METHOD("weight", TargetT, MLIntegerT) {
+//<Target
+//<Weight
+//>target
+// Sets the scheduling weight of :mini:`Target` to :mini:`Weight` and returns :mini:`Target`.
+// The weight is added to the recorded build duration (in milliseconds) of :mini:`Target` when computing priorities, so targets known to be slow (and the targets they depend on) are started earlier.
+// Weights only affect targets whose priority has not been computed yet, i.e. they should be set when the target is defined.
+	target_t *Target = (target_t *)Args[0];
+	int Weight = ml_integer_value(Args[1]);
+	if (Weight < 0) return ml_error("ValueError", "Weight must be non-negative");
+	Target->Weight = Weight;
+	return Args[0];
+}
+
 ML_METHOD("priority", TargetT) {
 //<Target
 //>integer
@@ -360,13 +593,192 @@ static int target_print(target_t *Target, void *Data) {
 
 static int target_affect(target_t *Target, target_t *Depend) {
 	--Target->WaitCount;
-	if (Target->LastUpdated == STATE_QUEUED && Target->WaitCount == 0) {
-		targetqueue_insert(Target);
-		pthread_cond_broadcast(TargetAvailable);
+	if (Target->LastUpdated == STATE_QUEUED && Target->WaitCount == 0) target_ready(Target);
+	return 0;
+}
+
+static void target_wake_waiters(target_t *Target) {
+	target_waiter_t *Waiter = Target->Waiters;
+	Target->Waiters = NULL;
+	while (Waiter) {
+		target_waiter_t *Next = Waiter->Next;
+		target_resume_t *Resume = Waiter->Resume;
+		if (Resume) {
+			// Suspended build functions are resumed from the thread loop, not deep inside this update
+			Resume->Next = NULL;
+			ResumeTail[0] = Resume;
+			ResumeTail = &Resume->Next;
+			pthread_cond_signal(TargetAvailable);
+		} else {
+			target_waitgroup_t *Group = Waiter->Group;
+			if (--Group->Pending == 0) pthread_cond_signal(Group->Ready);
+		}
+		Waiter = Next;
 	}
+}
+
+static void target_pool_leave(target_t *Target) {
+	// Called when a build function finishes or starts waiting for other targets, the slot goes to the oldest deferred target
+	targetpool_t *Pool = Target->Pool;
+	if (!Pool) return;
+	target_t *Deferred = targetpool_release(Pool);
+	if (Deferred) target_ready(Deferred);
+}
+
+static void target_pool_enter(target_t *Target) {
+	if (Target->Pool) targetpool_resume(Target);
+}
+
+// Durations only count the time a build function is active: running on a thread or waiting for its own commands.
+// The timer is paused while the build waits for other targets and until a thread resumes it after a command.
+enum {
+	TIMER_OFF,
+	TIMER_RUNNING,
+	TIMER_PAUSED
+};
+
+void target_timer_start(target_t *Target) {
+	Target->Timer = TIMER_RUNNING;
+	Target->ActiveTime = 0;
+	clock_gettime(CLOCK_MONOTONIC, &Target->ActiveSince);
+}
+
+static int target_timer_pause(target_t *Target) {
+	if (Target->Timer != TIMER_RUNNING) return 0;
+	struct timespec Now;
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	Target->ActiveTime += (Now.tv_sec - Target->ActiveSince.tv_sec) * 1000000000LL + (Now.tv_nsec - Target->ActiveSince.tv_nsec);
+	Target->Timer = TIMER_PAUSED;
+	return 1;
+}
+
+static void target_timer_resume(target_t *Target) {
+	if (Target->Timer != TIMER_PAUSED) return;
+	Target->Timer = TIMER_RUNNING;
+	clock_gettime(CLOCK_MONOTONIC, &Target->ActiveSince);
+}
+
+int target_timer_stop(target_t *Target) {
+	// Returns the active time in milliseconds
+	target_timer_pause(Target);
+	Target->Timer = TIMER_OFF;
+	return Target->ActiveTime / 1000000;
+}
+
+static int target_overloaded(void) {
+	if (MaxLoad > 0) {
+		double Load;
+		if (getloadavg(&Load, 1) == 1 && Load >= MaxLoad) return 1;
+	}
+#ifdef Linux
+	if (MemoryReserve > 0) {
+		FILE *File = fopen("/proc/meminfo", "r");
+		if (File) {
+			char Line[128];
+			long Available = -1;
+			while (fgets(Line, sizeof(Line), File)) {
+				if (sscanf(Line, "MemAvailable: %ld kB", &Available) == 1) break;
+			}
+			fclose(File);
+			if (Available >= 0 && Available < MemoryReserve * 1024) return 1;
+		}
+	}
+#endif
 	return 0;
 }
 
+static void target_admit(void) {
+	// Only defer while another build function is running (or its command is), otherwise nothing would ever free up resources.
+	if (MaxLoad <= 0 && MemoryReserve <= 0) return;
+	while (RunningBuilds > 0 && target_overloaded()) {
+		// Members waiting in a batch were already admitted and count as running
+		if (targetbatch_flush_pending()) continue;
+		pthread_mutex_unlock(InterpreterLock);
+		usleep(100000);
+		pthread_mutex_lock(InterpreterLock);
+	}
+}
+
+// Once InterpreterLock is taken, minilang states are queued by this scheduler instead of the default one.
+// Loops running states until something has happened block in target_scheduler_run() without InterpreterLock
+// while nothing is queued, instead of spinning, and are woken whenever a state is queued or has run.
+
+typedef struct target_scheduled_t target_scheduled_t;
+
+struct target_scheduled_t {
+	target_scheduled_t *Next;
+	ml_state_t *State;
+	ml_value_t *Value;
+};
+
+static pthread_mutex_t SchedulerLock[1] = {PTHREAD_MUTEX_INITIALIZER};
+static pthread_cond_t SchedulerChanged[1] = {PTHREAD_COND_INITIALIZER};
+static target_scheduled_t *ScheduledHead = NULL, **ScheduledTail = &ScheduledHead;
+static int SchedulerWaiting = 0;
+
+static void target_scheduler_add(ml_scheduler_t *Scheduler, ml_state_t *State, ml_value_t *Value) {
+	// Can be called from any thread, with or without InterpreterLock
+	target_scheduled_t *Scheduled = new(target_scheduled_t);
+	Scheduled->State = State;
+	Scheduled->Value = Value;
+	pthread_mutex_lock(SchedulerLock);
+	ScheduledTail[0] = Scheduled;
+	ScheduledTail = &Scheduled->Next;
+	if (SchedulerWaiting) pthread_cond_broadcast(SchedulerChanged);
+	pthread_mutex_unlock(SchedulerLock);
+}
+
+static void target_scheduler_run(ml_scheduler_t *Scheduler) {
+	// Runs the oldest queued state, or waits until there is one or another thread has run one, callers recheck their condition either way
+	pthread_mutex_lock(SchedulerLock);
+	target_scheduled_t *Scheduled = ScheduledHead;
+	if (!Scheduled) {
+		pthread_mutex_unlock(InterpreterLock);
+		++SchedulerWaiting;
+		pthread_cond_wait(SchedulerChanged, SchedulerLock);
+		--SchedulerWaiting;
+		pthread_mutex_unlock(SchedulerLock);
+		pthread_mutex_lock(InterpreterLock);
+		return;
+	}
+	if (!(ScheduledHead = Scheduled->Next)) ScheduledTail = &ScheduledHead;
+	pthread_mutex_unlock(SchedulerLock);
+	Scheduled->State->run(Scheduled->State, Scheduled->Value);
+	pthread_mutex_lock(SchedulerLock);
+	if (SchedulerWaiting) pthread_cond_broadcast(SchedulerChanged);
+	pthread_mutex_unlock(SchedulerLock);
+}
+
+static ml_scheduler_t TargetScheduler[1] = {{target_scheduler_add, target_scheduler_run}};
+
+static void target_run_scheduler(target_t *Target) {
+	// Runs any minilang states queued by the scheduler until the build function of Target either completes or suspends
+	// (a suspended build has Waiting set to the target it is waiting for, or Suspended set).
+	ml_scheduler_t *Scheduler = ml_context_get_static(MLRootContext, ML_SCHEDULER_INDEX);
+	while (Target->LastUpdated == STATE_CHECKING && !Target->Waiting && !Target->Suspended) Scheduler->run(Scheduler);
+}
+
+void target_batch_call(target_t *Scope, ml_state_t *Caller, ml_value_t *Function, ml_value_t *Targets) {
+	// Calls a batch function with Scope (its first member) standing in as the building target, so the function is suspended
+	// while it waits for other targets or its commands like any other build function. Returns once it completes or suspends.
+	target_t *OldTarget = CurrentTarget, *OldSuspend = SuspendTarget, *OldBuilding = BuildingTarget;
+	context_t *OldContext = CurrentContext;
+	const char *OldDirectory = CurrentDirectory;
+	CurrentTarget = SuspendTarget = BuildingTarget = Scope;
+	CurrentContext = Scope->BuildContext;
+	CurrentDirectory = CurrentContext ? CurrentContext->FullPath : RootPath;
+	target_timer_start(Scope);
+	ml_value_t **Args = anew(ml_value_t *, 1);
+	Args[0] = Targets;
+	ml_call(Caller, Function, 1, Args);
+	target_run_scheduler(Scope);
+	BuildingTarget = OldBuilding;
+	SuspendTarget = OldSuspend;
+	CurrentDirectory = OldDirectory;
+	CurrentContext = OldContext;
+	CurrentTarget = OldTarget;
+}
+
 static int target_depends_fn(target_t *Depend, int *DependsLastUpdated) {
 	if (Depend->LastUpdated > *DependsLastUpdated) *DependsLastUpdated = Depend->LastUpdated;
 	/*if (Depend->LastUpdated == CurrentIteration) {
@@ -375,35 +787,44 @@ static int target_depends_fn(target_t *Depend, int *DependsLastUpdated) {
 	return 0;
 }
 
-static void target_rebuild(target_t *Target) {
+static void target_build_error(target_t *Target, ml_value_t *Result);
+
+static ml_value_t *target_build_arg(target_t *Target) {
+	// Batch functions always take a list of targets, even when a member is built on its own.
+	if (!Target->Batch) return (ml_value_t *)Target;
+	ml_value_t *Targets = ml_list();
+	ml_list_put(Targets, (ml_value_t *)Target);
+	return Targets;
+}
+
+static int target_rebuild(target_t *Target) {
 	target_t *Parent;
 	if (!Target->Build && (Parent = cache_parent_get(Target))) {
 		fprintf(stderr, "\e[34mRebuilding %s because of %s\n\e[0m", Parent->Id, Target->Id);
-		target_rebuild(Parent);
+		if (target_rebuild(Parent)) return 1;
 	}
 	if (Target->Build) {
-		target_t *OldTarget = CurrentTarget;
+		target_t *OldTarget = CurrentTarget, *OldSuspend = SuspendTarget, *OldBuilding = BuildingTarget;
 		context_t *OldContext = CurrentContext;
 		const char *OldDirectory = CurrentDirectory;
 
 		CurrentContext = Target->BuildContext;
 		CurrentTarget = Target;
 		CurrentDirectory = CurrentContext ? CurrentContext->FullPath : RootPath;
-		ml_value_t *Result = ml_simple_inline(Target->Build, 1, Target);
-		if (ml_is_error(Result)) {
-			fprintf(stderr, "\e[31mError: %s: %s\n\e[0m", Target->Id, ml_error_message(Result));
-			ml_source_t Source;
-			int Level = 0;
-			while (ml_error_source(Result, Level++, &Source)) {
-				fprintf(stderr, "\e[31m\t%s:%d\n\e[0m", Source.Name, Source.Line);
-			}
-			exit(1);
-		}
+		SuspendTarget = BuildingTarget = NULL;
+		ml_value_t *Result = ml_simple_inline(Target->Build, 1, target_build_arg(Target));
 
+		BuildingTarget = OldBuilding;
+		SuspendTarget = OldSuspend;
 		CurrentDirectory = OldDirectory;
 		CurrentContext = OldContext;
 		CurrentTarget = OldTarget;
+		if (ml_is_error(Result)) {
+			target_build_error(Target, Result);
+			return 1;
+		}
 	}
+	return 0;
 }
 
 /*
@@ -492,6 +913,481 @@ static int build_scan_target_list(ml_value_t *Depend, targetset_t *Scans) {
 	return 0;
 }
 
+typedef struct {
+	ml_state_t Base;
+	target_t *Target;
+	time_t FileTime;
+	int LastUpdated, DependsLastUpdated, Batched;
+	unsigned char BuildHash[SHA256_BLOCK_SIZE];
+	unsigned char Previous[SHA256_BLOCK_SIZE];
+} target_update_t;
+
+static void target_update_init(target_update_t *Update, target_t *Target, time_t FileTime, int LastUpdated, int DependsLastUpdated, unsigned char BuildHash[SHA256_BLOCK_SIZE], unsigned char Previous[SHA256_BLOCK_SIZE]) {
+	Update->Target = Target;
+	Update->FileTime = FileTime;
+	Update->LastUpdated = LastUpdated;
+	Update->DependsLastUpdated = DependsLastUpdated;
+	memcpy(Update->BuildHash, BuildHash, SHA256_BLOCK_SIZE);
+	memcpy(Update->Previous, Previous, SHA256_BLOCK_SIZE);
+}
+
+static void target_update_finish(target_update_t *Update);
+
+static void target_build_error(target_t *Target, ml_value_t *Result) {
+	fprintf(stderr, "\e[31mError: %s: %s\n\e[0m", Target->Id, ml_error_message(Result));
+	ml_source_t Source;
+	int Level = 0;
+	while (ml_error_source(Result, Level++, &Source)) {
+		fprintf(stderr, "\e[31m\t%s:%d\n\e[0m", Source.Name, Source.Line);
+	}
+	if (ForkTarget) target_fork_fail();
+	if (!KeepGoing) exit(1);
+}
+
+typedef struct target_failure_t target_failure_t;
+
+struct target_failure_t {
+	target_failure_t *Next;
+	target_t *Target;
+	const char *Message;
+};
+
+static target_failure_t *Failures = NULL, **FailuresTail = &Failures;
+static int FailedTargets = 0, SkippedTargets = 0;
+
+static int target_depend_failed(target_t *Depend, void *Data) {
+	return Depend->Failed;
+}
+
+static void target_failed(target_t *Target, const char *Message) {
+	// Only used with -k. A failed target counts as done so waiters and dependents carry on, but nothing is written to the cache
+	// so it is checked again next time. Message is NULL if Target was skipped because one of its dependencies failed.
+	Target->Failed = 1;
+	if (Message) {
+		target_failure_t *Failure = new(target_failure_t);
+		Failure->Target = Target;
+		Failure->Message = Message;
+		FailuresTail[0] = Failure;
+		FailuresTail = &Failure->Next;
+		++FailedTargets;
+	} else {
+		++SkippedTargets;
+	}
+	if (Target->Type == ExprT) {
+		((target_expr_t *)Target)->Value = ml_error("BuildError", "Target %s failed", Target->Id);
+	}
+	Target->LastUpdated = CurrentIteration;
+	++BuiltTargets;
+	if (StatusUpdates) {
+		printf("\e[35m%d / %d\e[0m #%d %s \e[31m%s\e[0m\n", BuiltTargets, QueuedTargets, CurrentThread->Id, Message ? "Failed" : "Skipped", Target->Id);
+	}
+	if (ProgressBar) display_progress();
+	target_wake_waiters(Target);
+	target_ready_begin();
+	targetset_foreach(Target->Affects, Target, (void *)target_affect);
+	target_ready_end();
+}
+
+int target_failures_report(void) {
+	if (!FailedTargets) return 0;
+	fprintf(stderr, "\e[31m%d target(s) failed", FailedTargets);
+	if (SkippedTargets) fprintf(stderr, ", %d skipped because a dependency failed", SkippedTargets);
+	fprintf(stderr, ":\n");
+	for (target_failure_t *Failure = Failures; Failure; Failure = Failure->Next) {
+		fprintf(stderr, "\t%s: %s\n", Failure->Target->Id, Failure->Message);
+	}
+	fprintf(stderr, "\e[0m");
+	return FailedTargets;
+}
+
+static void target_build_done(target_update_t *Update, ml_value_t *Result) {
+	target_t *Target = Update->Target;
+	int Active = target_timer_stop(Target);
+	--RunningBuilds;
+	target_pool_leave(Target);
+	if (ml_is_error(Result)) {
+		target_build_error(Target, Result);
+		return target_failed(Target, ml_error_message(Result));
+	}
+	if (KeepGoing && targetset_foreach(Target->BuildDepends, NULL, target_depend_failed)) return target_failed(Target, NULL);
+	// Batched targets have their share of the batch duration set already
+	if (!Update->Batched) Target->Duration = Active;
+	cache_duration_set(Target, Target->Duration);
+	if (Target->Type == ExprT) {
+		((target_expr_t *)Target)->Value = Result;
+		cache_expr_set(Target, Result);
+	} else if (Target->Type == ScanT) {
+		targetset_t Scans[1] = {TARGETSET_INIT};
+		int Invalid = !ml_is(Result, MLListT);
+		if (!Invalid) {
+			targetset_init(Scans, ml_list_length(Result));
+			Invalid = ml_list_foreach(Result, Scans, (void *)build_scan_target_list);
+		}
+		if (Invalid) {
+			const char *Message = "scan results must be a list of targets";
+			fprintf(stderr, "\e[31mError: %s: %s\n\e[0m", Target->Id, Message);
+			if (!KeepGoing) exit(1);
+			return target_failed(Target, Message);
+		}
+		target_wait_all(Scans, Target);
+		if (KeepGoing && targetset_foreach(Scans, NULL, target_depend_failed)) return target_failed(Target, NULL);
+		cache_scan_set(Target, Scans);
+		if (DependencyGraph) {
+			targetset_foreach(Scans, Target, (void *)target_graph_scans);
+		}
+	}
+	cache_depends_set(Target, Target->BuildDepends);
+	target_update_finish(Update);
+}
+
+static int target_fork_write(int *Fd, const char *Chars, size_t Length) {
+	while (Length) {
+		ssize_t Written = write(*Fd, Chars, Length);
+		if (Written < 0) {
+			if (errno == EINTR) continue;
+			return 1;
+		}
+		Chars += Written;
+		Length -= Written;
+	}
+	return 0;
+}
+
+static int target_fork_read(int Fd, char *Chars, size_t Length) {
+	while (Length) {
+		ssize_t Count = read(Fd, Chars, Length);
+		if (Count < 0) {
+			if (errno == EINTR) continue;
+			return 1;
+		}
+		if (Count == 0) return 1;
+		Chars += Count;
+		Length -= Count;
+	}
+	return 0;
+}
+
+static void target_fork_send(int Fd, ml_value_t *Message) {
+	// Messages between a worker and its parent are CBOR values prefixed with their length
+	ml_stringbuffer_t Buffer[1] = {ML_STRINGBUFFER_INIT};
+	ml_cbor_encode_to(Buffer, (void *)ml_stringbuffer_write, NULL, Message);
+	uint32_t Length = Buffer->Length;
+	// A failed write leaves a truncated message which the other side rejects
+	if (target_fork_write(&Fd, (const char *)&Length, sizeof(Length))) return;
+	ml_stringbuffer_drain(Buffer, &Fd, (void *)target_fork_write);
+}
+
+static ml_value_t *target_fork_receive(int Fd) {
+	// Returns NULL if the other side has exited or sent a truncated message
+	uint32_t Length;
+	if (target_fork_read(Fd, (char *)&Length, sizeof(Length))) return NULL;
+	char *Chars = snew(Length);
+	if (target_fork_read(Fd, Chars, Length)) return NULL;
+	ml_cbor_reader_t *Reader = ml_cbor_reader(NULL, NULL, NULL);
+	ml_cbor_reader_read(Reader, (unsigned char *)Chars, Length);
+	return ml_cbor_reader_get(Reader);
+}
+
+static int target_fork_depend(target_t *Depend, ml_value_t *Depends) {
+	ml_list_put(Depends, ml_string(Depend->Id, Depend->IdLength));
+	return 0;
+}
+
+static int target_fork_request_depend(target_t *Depend, ml_value_t *Depends) {
+	targetset_insert(ForkTarget->BuildDepends, Depend);
+	ml_list_put(Depends, ml_string(Depend->Id, Depend->IdLength));
+	return 0;
+}
+
+static void target_fork_fail(void) {
+	// Exits a worker without running atexit handlers or flushing buffers inherited from the parent (e.g. the dependency graph or build trace)
+	fflush(stdout);
+	fflush(stderr);
+	_exit(1);
+}
+
+static void target_fork_exit(ml_value_t *Result) {
+	// Sends ["done", Result, BuildDepends] to the parent, build depends are sent by id since targets may have been created here
+	ml_value_t *Depends = ml_list();
+	targetset_foreach(ForkTarget->BuildDepends, Depends, (void *)target_fork_depend);
+	ml_value_t *Message = ml_list();
+	ml_list_put(Message, ml_cstring("done"));
+	ml_list_put(Message, Result);
+	ml_list_put(Message, Depends);
+	target_fork_send(ForkPipe, Message);
+	fflush(stdout);
+	fflush(stderr);
+	_exit(0);
+}
+
+static int target_fork_pending(target_t *Depend, targetset_t *Pending) {
+	if (Depend->LastUpdated <= 0) targetset_insert(Pending, Depend);
+	return 0;
+}
+
+static void target_fork_request(targetset_t *Pending) {
+	// Sends ["wait", nil, Ids] to the parent and stays alive until it replies with [Id, LastUpdated, Failed, Value] for each target,
+	// so all the targets a single wait needs are built in one round trip and the build function is never restarted.
+	ml_value_t *Depends = ml_list();
+	targetset_foreach(Pending, Depends, (void *)target_fork_request_depend);
+	ml_value_t *Message = ml_list();
+	ml_list_put(Message, ml_cstring("wait"));
+	ml_list_put(Message, MLNil);
+	ml_list_put(Message, Depends);
+	target_fork_send(ForkPipe, Message);
+	ml_value_t *Reply = target_fork_receive(ForkReply);
+	if (!Reply || !ml_is(Reply, MLListT)) {
+		fprintf(stderr, "\e[31mError: %s: lost connection to main process\n\e[0m", ForkTarget->Id);
+		target_fork_fail();
+	}
+	ML_LIST_FOREACH(Reply, Iter) {
+		ml_list_node_t *Node = ml_list_head(Iter->Value);
+		target_t *Depend = target_create(ml_string_value(Node->Value));
+		Depend->LastUpdated = ml_integer_value(Node->Next->Value);
+		Depend->Failed = Node->Next->Next->Value == MLTrue;
+		if (Depend->Type == ExprT) ((target_expr_t *)Depend)->Value = Node->Next->Next->Next->Value;
+	}
+}
+
+static void target_fork_wait(target_t *Depend) {
+	targetset_t *Pending = targetset_new();
+	targetset_insert(Pending, Depend);
+	target_fork_request(Pending);
+	if (Depend->LastUpdated <= 0) {
+		fprintf(stderr, "\e[31mError: %s: main process did not build %s\n\e[0m", ForkTarget->Id, Depend->Id);
+		target_fork_fail();
+	}
+}
+
+static void target_fork_done(ml_state_t *State, ml_value_t *Result) {
+	if (ml_is_error(Result)) target_build_error(ForkTarget, Result);
+	if (ForkTarget->Type != ExprT && ForkTarget->Type != ScanT) Result = MLNil;
+	target_fork_exit(Result);
+}
+
+static void target_fork_child(target_t *Target, int Pipe, int Reply) {
+	setpgid(0, 0);
+	ForkTarget = Target;
+	ForkPipe = Pipe;
+	ForkReply = Reply;
+	cache_fork_child();
+	process_fork_child();
+	jobserver_fork_child();
+	targethash_fork_child();
+	worker_fork_child();
+	// States queued by other threads of the parent belong to builds that are not run here
+	pthread_mutex_init(SchedulerLock, NULL);
+	pthread_cond_init(SchedulerChanged, NULL);
+	ScheduledHead = NULL;
+	ScheduledTail = &ScheduledHead;
+	SchedulerWaiting = 0;
+	// Only this thread exists in the worker, make sure exiting on an error only kills its own commands
+	BuildThreads = CurrentThread;
+	if (CurrentThread) {
+		CurrentThread->Next = NULL;
+		CurrentThread->Child = 0;
+	}
+	ml_state_t *State = new(ml_state_t);
+	State->run = target_fork_done;
+	State->Context = MLRootContext;
+	ml_value_t **Args = anew(ml_value_t *, 1);
+	Args[0] = target_build_arg(Target);
+	ml_call(State, Target->Build, 1, Args);
+	target_run_scheduler(Target);
+	fprintf(stderr, "\e[31mError: %s: build function did not complete in worker process\n\e[0m", Target->Id);
+	target_fork_fail();
+}
+
+static ml_value_t *target_fork_reply(targetset_t *Requested) {
+	ml_value_t *Reply = ml_list();
+	for (int I = 0; I < Requested->Size; ++I) {
+		target_t *Depend = Requested->Targets[I];
+		if (!Depend) continue;
+		ml_value_t *Entry = ml_list();
+		ml_list_put(Entry, ml_string(Depend->Id, Depend->IdLength));
+		ml_list_put(Entry, ml_integer(Depend->LastUpdated));
+		ml_list_put(Entry, Depend->Failed ? MLTrue : MLFalse);
+		ml_value_t *Value = Depend->Type == ExprT ? ((target_expr_t *)Depend)->Value : NULL;
+		ml_list_put(Entry, Value ?: MLNil);
+		ml_list_put(Reply, Entry);
+	}
+	return Reply;
+}
+
+typedef struct target_fork_t target_fork_t;
+
+struct target_fork_t {
+	ml_state_t Base;
+	target_fork_t *Next, **Prev;
+	target_update_t *Update;
+	targetset_t *Requested, *Pending;
+	pid_t Child;
+	int Pipe, Reply, Token;
+};
+
+// Workers whose parent build is suspended, so they are killed on exit like the children of build threads.
+static target_fork_t *ForkWorkers = NULL;
+
+static void target_fork_finish(target_fork_t *Fork, ml_value_t *Message) {
+	target_update_t *Update = Fork->Update;
+	if ((Fork->Prev[0] = Fork->Next)) Fork->Next->Prev = Fork->Prev;
+	close(Fork->Pipe);
+	close(Fork->Reply);
+	pthread_mutex_unlock(InterpreterLock);
+	int Status;
+	int Error = process_wait(Fork->Child, -1, 0, NULL, NULL, &Status);
+	jobserver_release(Fork->Token);
+	pthread_mutex_lock(InterpreterLock);
+	if (Error) return target_build_done(Update, ml_error("WaitError", "error waiting for worker process"));
+	// The worker has already reported any error in the build function, target_build_done still has to release the pool and count the build as finished
+	if (!WIFEXITED(Status) || WEXITSTATUS(Status)) {
+		return target_build_done(Update, ml_error("ForkError", "build function failed in worker process"));
+	}
+	if (!Message || !ml_is(Message, MLListT) || ml_list_length(Message) != 3) {
+		return target_build_done(Update, ml_error("ForkError", "invalid message from worker process"));
+	}
+	return target_build_done(Update, ml_list_head(Message)->Next->Value);
+}
+
+static int target_fork_requested(target_fork_t *Fork, ml_value_t *Message) {
+	// Returns 1 if the worker is waiting for the targets in Fork->Pending, otherwise the build is finished.
+	// The worker's token is released while it waits, the targets it needs may need every token to build.
+	target_t *Target = Fork->Update->Target;
+	if (!Message || !ml_is(Message, MLListT) || ml_list_length(Message) != 3) {
+		target_fork_finish(Fork, Message);
+		return 0;
+	}
+	ml_list_node_t *Node = ml_list_head(Message);
+	Fork->Requested = targetset_new();
+	Fork->Pending = targetset_new();
+	ML_LIST_FOREACH(Node->Next->Next->Value, Iter) {
+		target_t *Depend = target_create(ml_string_value(Iter->Value));
+		targetset_insert(Target->BuildDepends, Depend);
+		targetset_insert(Fork->Requested, Depend);
+		target_fork_pending(Depend, Fork->Pending);
+	}
+	if (strcmp(ml_string_value(Node->Value), "wait")) {
+		target_fork_finish(Fork, Message);
+		return 0;
+	}
+	jobserver_release(Fork->Token);
+	return 1;
+}
+
+static void target_fork_reply_send(target_fork_t *Fork) {
+	Fork->Token = jobserver_acquire();
+	ml_value_t *Depends = target_fork_reply(Fork->Requested);
+	pthread_mutex_unlock(InterpreterLock);
+	target_fork_send(Fork->Reply, Depends);
+	pthread_mutex_lock(InterpreterLock);
+}
+
+static void target_fork_next(target_fork_t *Fork);
+
+static void target_fork_resumed(ml_state_t *Caller, target_t *Depend, ml_value_t **Args) {
+	// The worker has sent a message, it is written in one go so reading it does not block for long
+	target_fork_t *Fork = (target_fork_t *)Args[0];
+	pthread_mutex_unlock(InterpreterLock);
+	ml_value_t *Message = target_fork_receive(Fork->Pipe);
+	pthread_mutex_lock(InterpreterLock);
+	if (!target_fork_requested(Fork, Message)) return;
+	// Waits for the targets like check(), suspending again if any are not done yet
+	target_depends_auto_allx((ml_state_t *)Fork, Fork->Pending);
+}
+
+static void target_fork_waited(target_fork_t *Fork, ml_value_t *Result) {
+	target_fork_reply_send(Fork);
+	target_fork_next(Fork);
+}
+
+static void target_fork_next(target_fork_t *Fork) {
+	// Suspends the build until the worker sends its next message, the reactor resumes it on a build thread.
+	// Without the reactor or outside a build thread, this thread waits for each message and builds the targets requested itself.
+	if (target_suspendable()) {
+		ml_value_t *Args[1] = {(ml_value_t *)Fork};
+		target_resume_t *Resume = target_suspend((ml_state_t *)Fork, target_fork_resumed, 1, Args);
+		if (!process_watch_async(Fork->Pipe, (process_ready_fn)target_resume_later, Resume)) return;
+		target_suspend_cancel(Resume);
+	}
+	if (CurrentThread) CurrentThread->Child = Fork->Child;
+	for (;;) {
+		pthread_mutex_unlock(InterpreterLock);
+		ml_value_t *Message = target_fork_receive(Fork->Pipe);
+		pthread_mutex_lock(InterpreterLock);
+		if (!target_fork_requested(Fork, Message)) break;
+		target_wait_all(Fork->Pending, Fork->Update->Target);
+		target_fork_reply_send(Fork);
+	}
+	if (CurrentThread) CurrentThread->Child = 0;
+}
+
+static void target_fork_build(target_update_t *Update) {
+	// Runs the build function of Update->Target in a forked copy of this process without holding InterpreterLock.
+	// Each time the worker needs targets that are not done yet it sends their ids and waits, they are built here and their states sent back.
+	target_t *Target = Update->Target;
+	int Pipe[2], Reply[2];
+	if (pipe(Pipe) == -1) return target_build_done(Update, ml_error("PipeError", "failed to create pipe"));
+	if (pipe(Reply) == -1) {
+		close(Pipe[0]);
+		close(Pipe[1]);
+		return target_build_done(Update, ml_error("PipeError", "failed to create pipe"));
+	}
+	int Token = jobserver_acquire();
+	fflush(stdout);
+	fflush(stderr);
+	pid_t Child = fork();
+	if (!Child) {
+		close(Pipe[0]);
+		close(Reply[1]);
+		target_fork_child(Target, Pipe[1], Reply[0]);
+	}
+	close(Pipe[1]);
+	close(Reply[0]);
+	if (Child == -1) {
+		close(Pipe[0]);
+		close(Reply[1]);
+		jobserver_release(Token);
+		return target_build_done(Update, ml_error("ForkError", "failed to fork worker process"));
+	}
+	target_fork_t *Fork = new(target_fork_t);
+	Fork->Base.run = (ml_state_fn)target_fork_waited;
+	Fork->Base.Context = MLRootContext;
+	Fork->Update = Update;
+	Fork->Child = Child;
+	Fork->Pipe = Pipe[0];
+	Fork->Reply = Reply[1];
+	Fork->Token = Token;
+	if ((Fork->Next = ForkWorkers)) ForkWorkers->Prev = &Fork->Next;
+	Fork->Prev = &ForkWorkers;
+	ForkWorkers = Fork;
+	target_fork_next(Fork);
+}
+
+static void target_update_hashed(ml_state_t *Caller, target_t *Depend, ml_value_t **Args) {
+	target_update_finish((target_update_t *)Caller);
+}
+
+static int target_update_hash_later(target_update_t *Local) {
+	// A source file still being hashed by a hashing thread is suspended like a build function waiting on a command,
+	// so this thread builds other targets meanwhile. The update is finished on a build thread once the hash is ready.
+	if (!HashThreads || !MaxThreads || ThreadsFinished || ForkTarget) return 0;
+	target_t *Target = Local->Target;
+	target_update_t *Update = new(target_update_t);
+	*Update = *Local;
+	target_resume_t *Resume = new(target_resume_t);
+	Resume->Caller = (ml_state_t *)Update;
+	Resume->Waiter = Target;
+	Resume->Context = CurrentContext;
+	Resume->Directory = CurrentDirectory;
+	Resume->Value = target_update_hashed;
+	Target->Suspended = 1;
+	++SuspendedBuilds;
+	// The hashing thread may finish straight away, target_resume_later() then waits for InterpreterLock
+	if (target_file_hash_later((target_file_t *)Target, Update->FileTime, (targethash_done_fn)target_resume_later, Resume)) return 1;
+	target_suspend_cancel(Resume);
+	return 0;
+}
+
 static void target_update(target_t *Target) {
 	if (DebugThreads) {
 		CurrentThread->Status = BUILD_UPDATE;
@@ -503,6 +1399,9 @@ static void target_update(target_t *Target) {
 		targetset_foreach(Target->Depends, Target, (void *)target_graph_depends);
 	}
 	Target->LastUpdated = STATE_CHECKING;
+	// Sets decoded by target_readahead() when Target was queued are only used by this update
+	targetset_t *CachedDepends = Target->CachedDepends, *CachedScans = Target->CachedScans;
+	Target->CachedDepends = Target->CachedScans = NULL;
 	int DependsLastUpdated = 0;
 	unsigned char BuildHash[SHA256_BLOCK_SIZE];
 	if (Target->Build) {
@@ -526,37 +1425,39 @@ static void target_update(target_t *Target) {
 	} else {
 		memset(BuildHash, 0, SHA256_BLOCK_SIZE);
 	}
-	targetset_foreach(Target->Depends, Target, (void *)target_wait);
+	target_wait_all(Target->Depends, Target);
 	if (DebugThreads) {
 		CurrentThread->Status = BUILD_UPDATE;
 		CurrentThread->Target = Target;
 		display_threads();
 	}
 	targetset_foreach(Target->Depends, &DependsLastUpdated, (void *)target_depends_fn);
+	if (KeepGoing && targetset_foreach(Target->Depends, NULL, target_depend_failed)) return target_failed(Target, NULL);
 
 	unsigned char Previous[SHA256_BLOCK_SIZE];
 	int LastUpdated, LastChecked;
 	time_t FileTime = 0;
 	cache_hash_get(Target, &LastUpdated, &LastChecked, &FileTime, Previous);
 	if (DependsLastUpdated <= LastChecked) {
-		targetset_t *Depends = cache_depends_get(Target);
+		targetset_t *Depends = CachedDepends ?: cache_depends_get(Target);
 		if (Depends) {
 			if (DependencyGraph) {
 				targetset_foreach(Depends, Target, (void *)target_graph_depends);
 			}
-			targetset_foreach(Depends, Target, (void *)target_queue);
-			targetset_foreach(Depends, Target, (void *)target_wait);
+			target_wait_all(Depends, Target);
 			targetset_foreach(Depends, &DependsLastUpdated, (void *)target_depends_fn);
+			if (KeepGoing && targetset_foreach(Depends, NULL, target_depend_failed)) return target_failed(Target, NULL);
 		}
 	}
 	if ((DependsLastUpdated > LastChecked) || target_missing(Target, LastChecked)) {
 		target_t *Parent;
 		if (!Target->Build && (Parent = cache_parent_get(Target))) {
 			fprintf(stderr, "\e[34mRebuilding %s because of %s\n\e[0m", Parent->Id, Target->Id);
-			target_rebuild(Parent);
+			if (target_rebuild(Parent)) return target_failed(Target, concat("failed to rebuild ", Parent->Id, NULL));
 			Target->LastUpdated = STATE_UNCHECKED;
 			--QueuedTargets;
 			target_queue(Target, NULL);
+			target_wake_waiters(Target);
 			return;
 		}
 		if (DebugThreads) {
@@ -565,68 +1466,108 @@ static void target_update(target_t *Target) {
 			display_threads();
 		}
 		if (Target->Build) {
-			target_t *OldTarget = CurrentTarget;
+			if (Target->Pool && !targetpool_acquire(Target)) {
+				// The pool filled up while the dependencies were checked, Target is queued again once a slot is released
+				Target->LastUpdated = STATE_QUEUED;
+				return;
+			}
+			target_admit();
+			target_update_t *Update = new(target_update_t);
+			Update->Base.run = (ml_state_fn)target_build_done;
+			Update->Base.Context = MLRootContext;
+			target_update_init(Update, Target, FileTime, LastUpdated, DependsLastUpdated, BuildHash, Previous);
+			target_t *OldTarget = CurrentTarget, *OldSuspend = SuspendTarget, *OldBuilding = BuildingTarget;
 			context_t *OldContext = CurrentContext;
 			const char *OldDirectory = CurrentDirectory;
 			CurrentContext = Target->BuildContext;
-			CurrentTarget = Target;
+			CurrentTarget = BuildingTarget = Target;
+			SuspendTarget = NULL;
 			CurrentDirectory = CurrentContext ? CurrentContext->FullPath : RootPath;
-			ml_value_t *Result = ml_simple_inline(Target->Build, 1, Target);
-			if (ml_is_error(Result)) {
-				fprintf(stderr, "\e[31mError: %s: %s\n\e[0m", Target->Id, ml_error_message(Result));
-				ml_source_t Source;
-				int Level = 0;
-				while (ml_error_source(Result, Level++, &Source)) {
-					fprintf(stderr, "\e[31m\t%s:%d\n\e[0m", Source.Name, Source.Line);
-				}
-				exit(1);
-			}
-			if (Target->Type == ExprT) {
-				((target_expr_t *)Target)->Value = Result;
-				cache_expr_set(Target, Result);
-			} else if (Target->Type == ScanT) {
-				targetset_t Scans[1] = {TARGETSET_INIT};
-				if (!ml_is(Result, MLListT)) {
-					fprintf(stderr, "\e[31mError: %s: scan results must be a list of targets\n\e[0m", Target->Id);
-					exit(1);
-				}
-				targetset_init(Scans, ml_list_length(Result));
-				if (ml_list_foreach(Result, Scans, (void *)build_scan_target_list)) {
-					fprintf(stderr, "\e[31mError: %s: scan results must be a list of targets\n\e[0m", Target->Id);
-					exit(1);
-				}
-				targetset_foreach(Scans, Target, (void *)target_queue);
-				targetset_foreach(Scans, Target, (void *)target_wait);
-				cache_scan_set(Target, Scans);
-				if (DependencyGraph) {
-					targetset_foreach(Scans, Target, (void *)target_graph_scans);
-				}
+			target_timer_start(Target);
+			++RunningBuilds;
+			ml_value_t **Args = anew(ml_value_t *, 1);
+			Args[0] = (ml_value_t *)Target;
+			if (Target->Fork && !ForkTarget) {
+				// The build is suspended while the worker runs, target_build_done is called by the thread that resumes it
+				SuspendTarget = Target;
+				target_fork_build(Update);
+			} else if (Target->Batch && !ForkTarget) {
+				// Building continues in target_build_done once the batch containing Target has been built
+				Update->Batched = 1;
+				targetbatch_add(Target->Batch, Target, (ml_state_t *)Update);
+			} else {
+				// If the build function suspends waiting for another target, this returns with Target still being checked
+				// and target_build_done is called later by the thread that resumes it.
+				SuspendTarget = Target;
+				ml_call((ml_state_t *)Update, Target->Build, 1, Args);
+				target_run_scheduler(Target);
 			}
-			cache_depends_set(Target, Target->BuildDepends);
+			BuildingTarget = OldBuilding;
+			SuspendTarget = OldSuspend;
 			CurrentDirectory = OldDirectory;
 			CurrentContext = OldContext;
 			CurrentTarget = OldTarget;
+			return;
 		}
 	} else {
 		if (Target->Type == ScanT) {
-			targetset_t *Scans = cache_scan_get(Target);
+			targetset_t *Scans = CachedScans ?: cache_scan_get(Target);
 			if (DependencyGraph) {
 				targetset_foreach(Scans, Target, (void *)target_graph_scans);
 			}
-			targetset_foreach(Scans, Target, (void *)target_queue);
-			targetset_foreach(Scans, Target, (void *)target_wait);
+			target_wait_all(Scans, Target);
 		}
 	}
+	target_update_t Update[1];
+	target_update_init(Update, Target, FileTime, LastUpdated, DependsLastUpdated, BuildHash, Previous);
+	if (Target->Type == FileT && target_update_hash_later(Update)) return;
+	target_update_finish(Update);
+}
+
+static void target_trace_string(const char *String) {
+	// Fields are tab separated and lines are newline terminated, so escape both (and backslash) in ids and pool names.
+	for (const char *P = String; *P; ++P) switch (*P) {
+	case '\\': fputs("\\\\", BuildTrace); break;
+	case '\t': fputs("\\t", BuildTrace); break;
+	case '\n': fputs("\\n", BuildTrace); break;
+	default: fputc(*P, BuildTrace); break;
+	}
+}
+
+static int target_trace_depend(target_t *Depend, void *Data) {
+	fputc('\t', BuildTrace);
+	target_trace_string(Depend->Id);
+	return 0;
+}
+
+static void target_trace(target_t *Target) {
+	// One line per target for rabs --simulate: duration, build flag, weight, pool limit, pool name, id and dependency ids.
+	// Targets that were not rebuilt this time use their last recorded duration.
+	int Duration = 0;
+	if (Target->Build) Duration = Target->Duration >= 0 ? Target->Duration : cache_duration_get(Target);
+	targetpool_t *Pool = Target->Pool;
+	fprintf(BuildTrace, "%d\t%d\t%d\t%d\t", Duration, !!Target->Build, Target->Weight, Pool ? Pool->Limit : 0);
+	if (Pool) target_trace_string(Pool->Name);
+	fputc('\t', BuildTrace);
+	target_trace_string(Target->Id);
+	targetset_foreach(Target->Depends, NULL, target_trace_depend);
+	targetset_foreach(Target->BuildDepends, NULL, target_trace_depend);
+	fputc('\n', BuildTrace);
+}
+
+static void target_update_finish(target_update_t *Update) {
+	target_t *Target = Update->Target;
+	if (BuildTrace) target_trace(Target);
 	if (DependencyGraph) {
 		targetset_foreach(Target->BuildDepends, Target, (void *)target_graph_build_depends);
 	}
-	cache_build_hash_set(Target, BuildHash);
-	FileTime = target_hash(Target, FileTime, Previous, DependsLastUpdated);
-	if (!LastUpdated || memcmp(Previous, Target->Hash, SHA256_BLOCK_SIZE)) {
+	cache_build_hash_set(Target, Update->BuildHash);
+	time_t FileTime = target_hash(Target, Update->FileTime, Update->Previous, Update->DependsLastUpdated);
+	if (!Update->LastUpdated || memcmp(Update->Previous, Target->Hash, SHA256_BLOCK_SIZE)) {
 		Target->LastUpdated = CurrentIteration;
 		cache_hash_set(Target, FileTime);
 	} else {
-		Target->LastUpdated = LastUpdated;
+		Target->LastUpdated = Update->LastUpdated;
 		cache_last_check_set(Target, FileTime);
 	}
 	++BuiltTargets;
@@ -638,9 +1579,11 @@ static void target_update(target_t *Target) {
 		}
 	}
 	if (ProgressBar) display_progress();
-	pthread_cond_broadcast(TargetUpdated);
+	target_wake_waiters(Target);
 
+	target_ready_begin();
 	targetset_foreach(Target->Affects, Target, (void *)target_affect);
+	target_ready_end();
 
 #ifdef Linux
 	if (WatchMode && !Target->Build && Target->Type == FileT) {
@@ -649,7 +1592,20 @@ static void target_update(target_t *Target) {
 #endif
 }
 
-int target_queue(target_t *Target, target_t *Waiter) {
+static int target_readahead_fn(target_t *Depend, void *Data) {
+	if (Depend->Type == FileT && !Depend->Build && Depend->LastUpdated == STATE_UNCHECKED) target_file_prefetch((target_file_t *)Depend);
+	return 0;
+}
+
+static void target_readahead(target_t *Target) {
+	// Starts hashing (or reading ahead) the source files Target depended on or scanned last time, these are only waited for
+	// once Target itself is updated which may be much later. The decoded sets are kept for target_update() to use.
+	if (!HashThreads && !ReadaheadThreads) return;
+	targetset_foreach(Target->CachedDepends = cache_depends_get(Target), NULL, target_readahead_fn);
+	if (Target->Type == ScanT) targetset_foreach(Target->CachedScans = cache_scan_get(Target), NULL, target_readahead_fn);
+}
+
+static int target_queue_visit(target_t *Target, target_t *Waiter) {
 	if (Target->LastUpdated > 0) return 0;
 	if (Waiter && targetset_insert(Target->Affects, Waiter)) {
 		Waiter->WaitCount += 1;
@@ -657,41 +1613,150 @@ int target_queue(target_t *Target, target_t *Waiter) {
 	if (Target->LastUpdated == STATE_UNCHECKED) {
 		Target->LastUpdated = STATE_QUEUED;
 		++QueuedTargets;
-		targetset_foreach(Target->Depends, Target, (void *)target_queue);
-		if (Target->WaitCount == 0) {
-			targetqueue_insert(Target);
-			pthread_cond_broadcast(TargetAvailable);
+		if (Target->Type == FileT && !Target->Build) {
+			target_file_prefetch((target_file_t *)Target);
+		} else {
+			target_readahead(Target);
 		}
-	} else if (Target->LastUpdated == STATE_QUEUED) {
-		target_priority_invalidate(Target);
+		return 1;
+	} else if (Target->LastUpdated == STATE_QUEUED && Waiter) {
+		target_priority_raise(Target, Waiter);
 	}
 	return 0;
 }
 
-int target_wait(target_t *Target, target_t *Waiter) {
-	if (Waiter) {
-		//fprintf(stderr, "\e[34m%s waiting:\n\e[0m", Waiter->Id);
-		for (target_t *Waiting = Target; Waiting; Waiting = Waiting->Waiting) {
-			//fprintf(stderr, "\e[34m\t%s\n\e[0m", Waiting->Id);
-			if (Waiting == Waiter) {
-				fprintf(stderr, "\e[31mError: %s has recursive dependency:", Waiter->Id);
-				for (target_t *Waiting = Target; Waiting; Waiting = Waiting->Waiting) {
-					fprintf(stderr, " -> %s", Waiting->Id);
-				}
-				fprintf(stderr, "\n\e[0m");
-				exit(1);
+static inline void queue_push(int *Top, target_t *Target) {
+	if (*Top == QueueStackSize) {
+		int NewSize = QueueStackSize ? 2 * QueueStackSize : 64;
+		queue_frame_t *NewStack = anew(queue_frame_t, NewSize);
+		if (QueueStack) memcpy(NewStack, QueueStack, QueueStackSize * sizeof(queue_frame_t));
+		QueueStack = NewStack;
+		QueueStackSize = NewSize;
+	}
+	QueueStack[*Top].Target = Target;
+	QueueStack[*Top].Index = 0;
+	++*Top;
+}
+
+static int target_queue_recursive(target_t *Target, target_t *Waiter) {
+	// Queues Target and its unchecked dependencies depth first using an explicit stack, a target is made ready once
+	// all its dependencies have been visited and none of them are pending.
+	if (!target_queue_visit(Target, Waiter)) return 0;
+	int Top = 0;
+	queue_push(&Top, Target);
+	while (Top) {
+		queue_frame_t *Frame = QueueStack + Top - 1;
+		target_t *Next = Frame->Target;
+		targetset_t *Depends = Next->Depends;
+		while (Frame->Index < Depends->Size) {
+			target_t *Depend = Depends->Targets[Frame->Index++];
+			if (Depend && target_queue_visit(Depend, Next)) {
+				queue_push(&Top, Depend);
+				break;
+			}
+		}
+		if (QueueStack[Top - 1].Target != Next) continue;
+		QueueStack[--Top].Target = NULL;
+		if (Next->WaitCount == 0) target_ready(Next);
+	}
+	return 0;
+}
+
+int target_queue(target_t *Target, target_t *Waiter) {
+	target_ready_begin();
+	target_queue_recursive(Target, Waiter);
+	target_ready_end();
+	return 0;
+}
+
+static void target_queue_all(targetset_t *Set, target_t *Waiter) {
+	target_ready_begin();
+	targetset_foreach(Set, Waiter, (void *)target_queue_recursive);
+	target_ready_end();
+}
+
+static void target_check_recursive(target_t *Target, target_t *Waiter) {
+	//fprintf(stderr, "\e[34m%s waiting:\n\e[0m", Waiter->Id);
+	for (target_t *Waiting = Target; Waiting; Waiting = Waiting->Waiting) {
+		//fprintf(stderr, "\e[34m\t%s\n\e[0m", Waiting->Id);
+		if (Waiting == Waiter) {
+			fprintf(stderr, "\e[31mError: %s has recursive dependency:", Waiter->Id);
+			for (target_t *Waiting = Target; Waiting; Waiting = Waiting->Waiting) {
+				fprintf(stderr, " -> %s", Waiting->Id);
 			}
+			fprintf(stderr, "\n\e[0m");
+			exit(1);
 		}
+	}
+}
+
+static int target_thread_add(void) {
+	// Unparks a spare thread or spawns a new one. At most 2 * MaxThreads threads are kept, so long chains of
+	// blocked threads do not grow the number of threads without bound, returns 0 if that limit has been reached.
+	if (ParkedThreads) {
+		--ParkedThreads;
+		++ActiveThreads;
+		++SpareTokens;
+		pthread_cond_signal(SpareAvailable);
+		return 1;
+	}
+	if (ActiveThreads >= 2 * MaxThreads) return 0;
+	target_thread_spawn();
+	return 1;
+}
+
+static void target_block(target_waitgroup_t *Group) {
+	// Only build threads are compensated, the main thread has no queue
+	int Compensate = CurrentThread && CurrentThread->Queue && Group->Pending;
+	if (Compensate) {
+		++BlockedThreads;
+		if (ActiveThreads - BlockedThreads < MaxThreads) target_thread_add();
+	}
+	// Targets in partial batches could be what this thread is waiting for
+	targetbatch_flush_pending();
+	while (Group->Pending) pthread_cond_wait(Group->Ready, InterpreterLock);
+	pthread_cond_destroy(Group->Ready);
+	if (Compensate) --BlockedThreads;
+}
+
+int target_wait(target_t *Target, target_t *Waiter) {
+	if (ForkTarget && Target->LastUpdated <= 0) target_fork_wait(Target);
+	if (Waiter) {
+		target_check_recursive(Target, Waiter);
 		Waiter->Waiting = Target;
 	}
-	if (Target->LastUpdated == STATE_QUEUED) {
-		target_update(Target);
-	} else while (Target->LastUpdated == STATE_CHECKING) {
-		if (DebugThreads) {
-			CurrentThread->Status = BUILD_WAIT;
-			CurrentThread->Target = Target;
+	int Paused = Waiter && Waiter == BuildingTarget;
+	if (Paused) {
+		--RunningBuilds;
+		BuildingTarget = NULL;
+		target_pool_leave(Waiter);
+	}
+	int Timed = Waiter && target_timer_pause(Waiter);
+	for (;;) {
+		// Targets deferred by a full pool are left to the queue, updating them inline would only defer them again
+		if (Target->LastUpdated == STATE_QUEUED && !targetpool_full(Target) && UpdateDepth < MAX_UPDATE_DEPTH) {
+			targetqueue_remove(Target);
+			++UpdateDepth;
+			target_update(Target);
+			--UpdateDepth;
+		} else if (Target->LastUpdated == STATE_QUEUED || Target->LastUpdated == STATE_CHECKING) {
+			if (DebugThreads) {
+				CurrentThread->Status = BUILD_WAIT;
+				CurrentThread->Target = Target;
+			}
+			target_waitgroup_t Group[1] = {{{PTHREAD_COND_INITIALIZER}, 1}};
+			target_waiter_t Blocked[1] = {{Target->Waiters, Group}};
+			Target->Waiters = Blocked;
+			target_block(Group);
+		} else {
+			break;
 		}
-		pthread_cond_wait(TargetUpdated, InterpreterLock);
+	}
+	if (Timed) target_timer_resume(Waiter);
+	if (Paused) {
+		target_pool_enter(Waiter);
+		BuildingTarget = Waiter;
+		++RunningBuilds;
 	}
 	if (Waiter) Waiter->Waiting = NULL;
 	/*if (DebugThreads) {
@@ -701,6 +1766,262 @@ int target_wait(target_t *Target, target_t *Waiter) {
 	return 0;
 }
 
+static void target_wait_resumable(target_resume_t *Resume) {
+	target_t *Depend = Resume->Depend, *Waiter = Resume->Waiter;
+	if (ForkTarget && Depend->LastUpdated <= 0) target_fork_wait(Depend);
+	for (;;) {
+		if (Depend->LastUpdated == STATE_QUEUED && !targetpool_full(Depend) && UpdateDepth < MAX_UPDATE_DEPTH) {
+			Waiter->Waiting = Depend;
+			targetqueue_remove(Depend);
+			--RunningBuilds;
+			BuildingTarget = NULL;
+			target_pool_leave(Waiter);
+			target_timer_pause(Waiter);
+			++UpdateDepth;
+			target_update(Depend);
+			--UpdateDepth;
+			target_timer_resume(Waiter);
+			target_pool_enter(Waiter);
+			BuildingTarget = Waiter;
+			++RunningBuilds;
+			Waiter->Waiting = NULL;
+		} else if (Depend->LastUpdated == STATE_QUEUED || Depend->LastUpdated == STATE_CHECKING) {
+			// Suspend the calling build function instead of blocking this thread
+			Waiter->Waiting = Depend;
+			target_waiter_t *Blocked = new(target_waiter_t);
+			Blocked->Resume = Resume;
+			Blocked->Next = Depend->Waiters;
+			Depend->Waiters = Blocked;
+			--RunningBuilds;
+			target_pool_leave(Waiter);
+			target_timer_pause(Waiter);
+			return;
+		} else {
+			break;
+		}
+	}
+	return Resume->Value(Resume->Caller, Depend, Resume->Args);
+}
+
+static void target_resume(target_resume_t *Resume) {
+	target_t *OldTarget = CurrentTarget, *OldSuspend = SuspendTarget, *OldBuilding = BuildingTarget;
+	context_t *OldContext = CurrentContext;
+	const char *OldDirectory = CurrentDirectory;
+	target_t *Waiter = Resume->Waiter;
+	CurrentTarget = SuspendTarget = Waiter;
+	if (Resume->Building) {
+		// Only a build waiting for another target gave up its pool slot, not one waiting for its own command
+		if (Resume->Depend) target_pool_enter(Waiter);
+		BuildingTarget = Waiter;
+		++RunningBuilds;
+		target_timer_resume(Waiter);
+	} else {
+		BuildingTarget = NULL;
+	}
+	CurrentContext = Resume->Context;
+	CurrentDirectory = Resume->Directory;
+	Waiter->Waiting = NULL;
+	if (Resume->Depend) {
+		target_wait_resumable(Resume);
+	} else {
+		Waiter->Suspended = 0;
+		Resume->Value(Resume->Caller, NULL, Resume->Args);
+	}
+	target_run_scheduler(Waiter);
+	BuildingTarget = OldBuilding;
+	SuspendTarget = OldSuspend;
+	CurrentDirectory = OldDirectory;
+	CurrentContext = OldContext;
+	CurrentTarget = OldTarget;
+}
+
+int target_suspendable(void) {
+	// Only build functions called from a build thread's scheduler loop can be suspended, not code run inline
+	return SuspendTarget && SuspendTarget == CurrentTarget && MaxThreads > 0 && !ThreadsFinished && !ForkTarget;
+}
+
+target_resume_t *target_suspend(ml_state_t *Caller, target_value_fn Value, int Count, ml_value_t **Args) {
+	// Must only be called if target_suspendable() returned true, the caller must then return without resuming Caller.
+	// Value(Caller, NULL, Args) is called on a build thread after target_resume_later().
+	target_t *Waiter = CurrentTarget;
+	target_resume_t *Resume = new(target_resume_t);
+	Resume->Caller = Caller;
+	Resume->Waiter = Waiter;
+	Resume->Context = CurrentContext;
+	Resume->Directory = CurrentDirectory;
+	Resume->Value = Value;
+	Resume->Args = anew(ml_value_t *, Count);
+	memcpy(Resume->Args, Args, Count * sizeof(ml_value_t *));
+	Resume->Building = 1;
+	Waiter->Suspended = 1;
+	++SuspendedBuilds;
+	return Resume;
+}
+
+void target_suspend_cancel(target_resume_t *Resume) {
+	// Undoes target_suspend() if the caller has to complete synchronously after all
+	Resume->Waiter->Suspended = 0;
+	--SuspendedBuilds;
+}
+
+void target_resume_later(target_resume_t *Resume) {
+	// Can be called from any thread without holding InterpreterLock
+	pthread_mutex_lock(InterpreterLock);
+	target_resume_queue(Resume);
+	pthread_mutex_unlock(InterpreterLock);
+}
+
+void target_resume_queue(target_resume_t *Resume) {
+	// As target_resume_later() for callers already holding InterpreterLock
+	Resume->Next = NULL;
+	ResumeTail[0] = Resume;
+	ResumeTail = &Resume->Next;
+	--SuspendedBuilds;
+	// The command has finished, the build counts as running again once resumed
+	if (Resume->Building) {
+		--RunningBuilds;
+		target_timer_pause(Resume->Waiter);
+	}
+	pthread_cond_signal(TargetAvailable);
+}
+
+void target_waitx(ml_state_t *Caller, target_t *Depend, target_value_fn Value, int Count, ml_value_t **Args) {
+	target_t *Waiter = CurrentTarget;
+	if (Waiter && Waiter != Depend) targetset_insert(Waiter->BuildDepends, Depend);
+	if (Waiter && Waiter != Depend && Waiter == SuspendTarget) {
+		target_queue(Depend, Waiter);
+		target_check_recursive(Depend, Waiter);
+		target_resume_t *Resume = new(target_resume_t);
+		Resume->Caller = Caller;
+		Resume->Depend = Depend;
+		Resume->Waiter = Waiter;
+		Resume->Context = CurrentContext;
+		Resume->Directory = CurrentDirectory;
+		Resume->Value = Value;
+		Resume->Args = anew(ml_value_t *, Count);
+		memcpy(Resume->Args, Args, Count * sizeof(ml_value_t *));
+		Resume->Building = 1;
+		return target_wait_resumable(Resume);
+	}
+	target_queue(Depend, Waiter);
+	target_wait(Depend, Waiter);
+	return Value(Caller, Depend, Args);
+}
+
+static void target_depends_auto_next(ml_state_t *Caller, target_t *Depend, ml_value_t **Args) {
+	targetset_t *Depends = (targetset_t *)Args[0];
+	int Index = ml_integer_value(Args[1]);
+	while (Index < Depends->Size) {
+		target_t *Next = Depends->Targets[Index++];
+		if (!Next || Next->LastUpdated > 0) continue;
+		Args[1] = ml_integer(Index);
+		return target_waitx(Caller, Next, target_depends_auto_next, 2, Args);
+	}
+	ML_RETURN(MLNil);
+}
+
+void target_depends_auto_allx(ml_state_t *Caller, targetset_t *Depends) {
+	// Queues every target first so they can be built in parallel, then waits for each in turn, suspending the caller as needed.
+	if (!CurrentTarget) ML_RETURN(MLNil);
+	target_queue_all(Depends, CurrentTarget);
+	ml_value_t *Args[2] = {(ml_value_t *)Depends, ml_integer(0)};
+	return target_depends_auto_next(Caller, NULL, Args);
+}
+
+static int target_wait_ready(target_t *Target, target_t *Waiter) {
+	if (Target->LastUpdated == STATE_QUEUED && Target->QueueIndex >= 0 && !targetpool_full(Target) && UpdateDepth < MAX_UPDATE_DEPTH) target_wait(Target, Waiter);
+	return 0;
+}
+
+static int target_wait_queued(target_t *Target, target_t *Waiter) {
+	if (Target->LastUpdated == STATE_QUEUED && !targetpool_full(Target) && UpdateDepth < MAX_UPDATE_DEPTH) target_wait(Target, Waiter);
+	return 0;
+}
+
+typedef struct {
+	target_t *Waiter;
+	target_waitgroup_t *Group;
+} target_wait_all_t;
+
+static int target_wait_pending(target_t *Target, target_wait_all_t *WaitAll) {
+	if (Target->LastUpdated == STATE_CHECKING || Target->LastUpdated == STATE_QUEUED) {
+		target_t *Waiter = WaitAll->Waiter;
+		if (Waiter) {
+			target_check_recursive(Target, Waiter);
+			if (!Waiter->Waiting) Waiter->Waiting = Target;
+		}
+		target_waiter_t *Blocked = new(target_waiter_t);
+		Blocked->Group = WaitAll->Group;
+		Blocked->Next = Target->Waiters;
+		Target->Waiters = Blocked;
+		++WaitAll->Group->Pending;
+	}
+	return 0;
+}
+
+static int target_threads_free(void) {
+	// Returns true if another thread can build queued targets while this one blocks, either an idle thread
+	// or a spare thread that target_block() will unpark or spawn to compensate.
+	if (IdleThreads) return 1;
+	if (!CurrentThread || !CurrentThread->Queue || !MaxThreads || ThreadsFinished) return 0;
+	return ParkedThreads || ActiveThreads < 2 * MaxThreads;
+}
+
+void target_wait_all(targetset_t *Set, target_t *Waiter) {
+	// Queues every target in Set so that idle threads can start on them straight away, then blocks until they have all finished.
+	// Only if no other thread is free to build them does this thread take ready targets in turn and update the remaining queued
+	// targets inline (which dispatches their own dependencies) before blocking.
+	if (ForkTarget) {
+		// Ask the main process for every target that is not done yet in one go
+		targetset_t *Pending = targetset_new();
+		targetset_foreach(Set, Pending, (void *)target_fork_pending);
+		if (targetset_size(Pending)) target_fork_request(Pending);
+		targetset_foreach(Set, Waiter, (void *)target_wait);
+		return;
+	}
+	target_queue_all(Set, Waiter);
+	int Paused = Waiter && Waiter == BuildingTarget;
+	if (Paused) {
+		--RunningBuilds;
+		BuildingTarget = NULL;
+		target_pool_leave(Waiter);
+	}
+	int Timed = Waiter && target_timer_pause(Waiter);
+	for (;;) {
+		if (!target_threads_free()) {
+			targetset_foreach(Set, Waiter, (void *)target_wait_ready);
+			targetset_foreach(Set, Waiter, (void *)target_wait_queued);
+		}
+		target_waitgroup_t Group[1] = {{{PTHREAD_COND_INITIALIZER}, 0}};
+		target_wait_all_t WaitAll[1] = {{Waiter, Group}};
+		targetset_foreach(Set, WaitAll, (void *)target_wait_pending);
+		if (!Group->Pending) break;
+		if (DebugThreads && Waiter) {
+			CurrentThread->Status = BUILD_WAIT;
+			CurrentThread->Target = Waiter->Waiting;
+		}
+		target_block(Group);
+		if (Waiter) Waiter->Waiting = NULL;
+	}
+	if (Timed) target_timer_resume(Waiter);
+	if (Paused) {
+		target_pool_enter(Waiter);
+		BuildingTarget = Waiter;
+		++RunningBuilds;
+	}
+}
+
+static void target_threads_finish(void) {
+	ThreadsFinished = 1;
+	pthread_cond_broadcast(TargetAvailable);
+	pthread_cond_broadcast(SpareAvailable);
+}
+
+static void target_threads_stop(void) {
+	// Suspended build functions still need a thread to resume them, the build is not finished until they have
+	if (--RunningThreads == 0 && !SuspendedBuilds && !ResumeHead) target_threads_finish();
+}
+
 static void *target_thread_fn(void *Arg) {
 	GC_add_roots(&CurrentThread, &CurrentThread + 1);
 	GC_add_roots(&CurrentDirectory, &CurrentDirectory + 1);
@@ -711,20 +2032,52 @@ static void *target_thread_fn(void *Arg) {
 	pthread_mutex_lock(InterpreterLock);
 	++RunningThreads;
 	for (;;) {
-		target_t *NextTarget = targetqueue_next();
-		while (!NextTarget) {
+		if (ActiveThreads - BlockedThreads > MaxThreads) {
+			// A blocked thread has resumed, park until needed again
 			if (DebugThreads) CurrentThread->Status = BUILD_IDLE;
-			if (--RunningThreads == 0) {
-				pthread_cond_signal(TargetAvailable);
+			--ActiveThreads;
+			++ParkedThreads;
+			target_threads_stop();
+			while (!SpareTokens && !ThreadsFinished) pthread_cond_wait(SpareAvailable, InterpreterLock);
+			if (!SpareTokens) {
+				targetqueue_free(CurrentThread->Queue);
+				CurrentThread->Queue = NULL;
 				pthread_mutex_unlock(InterpreterLock);
 				return NULL;
 			}
+			--SpareTokens;
+			++RunningThreads;
+			continue;
+		}
+		target_resume_t *Resume = ResumeHead;
+		if (Resume) {
+			if (!(ResumeHead = Resume->Next)) ResumeTail = &ResumeHead;
+			target_resume(Resume);
+			continue;
+		}
+		if (targetbatch_flush_expired()) continue;
+		target_t *Target = targetqueue_next();
+		if (!Target) {
+			// Build partial batches before going idle, they would never fill up otherwise
+			if (targetbatch_flush_pending()) continue;
+			if (DebugThreads) CurrentThread->Status = BUILD_IDLE;
+			target_threads_stop();
+			if (ThreadsFinished) {
+				targetqueue_free(CurrentThread->Queue);
+				CurrentThread->Queue = NULL;
+				pthread_mutex_unlock(InterpreterLock);
+				return NULL;
+			}
+			++IdleThreads;
 			pthread_cond_wait(TargetAvailable, InterpreterLock);
+			--IdleThreads;
 			++RunningThreads;
-			NextTarget = targetqueue_next();
+			continue;
 		}
-		target_t *Target = NextTarget;
-		if (Target->LastUpdated == STATE_QUEUED) target_update(Target);
+		if (Target->LastUpdated != STATE_QUEUED) continue;
+		// Leave targets from a full pool until a slot is released and pick up other work instead
+		if (targetpool_defer(Target)) continue;
+		target_update(Target);
 	}
 	return NULL;
 }
@@ -738,20 +2091,87 @@ void target_threads_start(int NumThreads) {
 	RunningThreads = 1;
 	pthread_mutex_init(InterpreterLock, NULL);
 	pthread_mutex_lock(InterpreterLock);
-	for (LastThread = 0; LastThread < NumThreads; ++LastThread) {
-		build_thread_t *BuildThread = new(build_thread_t);
-		BuildThread->Id = LastThread;
-		BuildThread->Status = BUILD_IDLE;
-		pthread_create(&BuildThread->Handle, NULL, target_thread_fn, BuildThread);
-		BuildThread->Next = BuildThreads;
-		BuildThreads = BuildThread;
+	ml_context_set_static(MLRootContext, ML_SCHEDULER_INDEX, TargetScheduler);
+	MaxThreads = NumThreads;
+	for (LastThread = 0; LastThread < NumThreads;) target_thread_spawn();
+}
+
+static void target_threads_resize(int NumThreads) {
+	// Threads above the new limit park themselves when they next look for work
+	MaxThreads = NumThreads;
+	while (ActiveThreads - BlockedThreads < MaxThreads) {
+		if (!target_thread_add()) break;
+	}
+}
+
+typedef struct {
+	int MinThreads, MaxThreads, NumCpus;
+} target_adapt_t;
+
+static void *target_adapt_thread_fn(target_adapt_t *Adapt) {
+	// Samples system wide CPU usage every second. Adds a thread while every thread is busy but CPUs are idle and not waiting on I/O,
+	// removes one while I/O wait is high or the CPUs are saturated with more threads than CPUs. Job slots follow the thread count,
+	// since suspended commands do not hold threads the slots are what actually limits them.
+	cpuinfo_times_t Previous, Current;
+	if (cpuinfo_times(&Previous)) return NULL;
+	for (;;) {
+		sleep(1);
+		if (cpuinfo_times(&Current)) return NULL;
+		double Total = Current.Total - Previous.Total;
+		double Idle = Current.Idle - Previous.Idle;
+		double IOWait = Current.IOWait - Previous.IOWait;
+		Previous = Current;
+		if (Total <= 0) continue;
+		double Busy = (Total - Idle - IOWait) / Total;
+		IOWait /= Total;
+		pthread_mutex_lock(InterpreterLock);
+		if (ThreadsFinished) {
+			pthread_mutex_unlock(InterpreterLock);
+			return NULL;
+		}
+		int NumThreads = MaxThreads;
+		if (IOWait > 0.25 || (Busy > 0.95 && NumThreads > Adapt->NumCpus)) {
+			if (NumThreads > Adapt->MinThreads) --NumThreads;
+		} else if (!IdleThreads && Busy < 0.85 && IOWait < 0.1) {
+			if (NumThreads < Adapt->MaxThreads) ++NumThreads;
+		}
+		if (NumThreads != MaxThreads) {
+			if (StatusUpdates) printf("\e[34mAdjusting build threads to %d (cpu %.0f%%, iowait %.0f%%)\e[0m\n", NumThreads, Busy * 100, IOWait * 100);
+			target_threads_resize(NumThreads);
+			jobserver_resize(NumThreads);
+		}
+		pthread_mutex_unlock(InterpreterLock);
 	}
+	return NULL;
+}
+
+void target_threads_adapt(int NumCpus, int Limit) {
+	// Must be called after target_threads_start, with up to Limit threads allowed
+	target_adapt_t *Adapt = new(target_adapt_t);
+	Adapt->MinThreads = 1;
+	Adapt->MaxThreads = Limit;
+	Adapt->NumCpus = NumCpus;
+	pthread_t Thread;
+	pthread_create(&Thread, NULL, (void *)target_adapt_thread_fn, Adapt);
+	pthread_detach(Thread);
+}
+
+static void target_thread_spawn(void) {
+	build_thread_t *BuildThread = new(build_thread_t);
+	BuildThread->Id = LastThread++;
+	BuildThread->Status = BUILD_IDLE;
+	BuildThread->Queue = targetqueue_new();
+	++ActiveThreads;
+	pthread_create(&BuildThread->Handle, NULL, target_thread_fn, BuildThread);
+	BuildThread->Next = BuildThreads;
+	BuildThreads = BuildThread;
 }
 
 void target_interactive_start(int NumThreads) {
 	RunningThreads = 0;
 	pthread_mutex_init(InterpreterLock, NULL);
 	pthread_mutex_lock(InterpreterLock);
+	ml_context_set_static(MLRootContext, ML_SCHEDULER_INDEX, TargetScheduler);
 	/*for (LastThread = 0; LastThread < NumThreads; ++LastThread) {
 		build_thread_t *BuildThread = new(build_thread_t);
 		BuildThread->Id = LastThread;
@@ -765,15 +2185,27 @@ void target_interactive_start(int NumThreads) {
 }
 
 void target_threads_wait() {
-	--RunningThreads;
-	pthread_mutex_unlock(InterpreterLock);
-	while (BuildThreads) {
-		pthread_join(BuildThreads->Handle, NULL);
-		BuildThreads = BuildThreads->Next;
+	target_threads_stop();
+	build_thread_t *Joined = NULL;
+	for (;;) {
+		// Spare threads may still be spawned (at the head of the list) while joining
+		build_thread_t *Head = BuildThreads;
+		pthread_mutex_unlock(InterpreterLock);
+		if (Head == Joined) break;
+		for (build_thread_t *Thread = Head; Thread != Joined; Thread = Thread->Next) {
+			pthread_join(Thread->Handle, NULL);
+		}
+		Joined = Head;
+		pthread_mutex_lock(InterpreterLock);
 	}
 }
 
 static void target_threads_kill(void) {
+	process_kill_async();
+	for (target_fork_t *Fork = ForkWorkers; Fork; Fork = Fork->Next) {
+		fprintf(stderr, "\e[31mKilling worker process %d\n\e[0m", Fork->Child);
+		killpg(Fork->Child, SIGKILL);
+	}
 	for (build_thread_t *Thread = BuildThreads; Thread; Thread = Thread->Next) {
 		if (Thread->Child) {
 			fprintf(stderr, "\e[31mKilling child process %d\n\e[0m", Thread->Child);
@@ -797,13 +2229,16 @@ static ml_value_t *decode_target(ml_cbor_reader_t *Reader, int Count, ml_value_t
 	ML_CHECK_ARG_COUNT(1);
 	ML_CHECK_ARG_TYPE(0, MLStringT);
 	const char *Id = ml_string_value(Args[0]);
-	target_t *Target = target_find(Id);
+	// A worker's copy of the index predates targets the parent created since the fork, anywhere else unknown ids are an error
+	target_t *Target = ForkTarget ? target_create(Id) : target_find(Id);
 	if (!Target) return ml_error("TargetError", "Target not defined: %s", Id);
 	return (ml_value_t *)Target;
 }
 
 void target_init(void) {
 	targetqueue_init();
+	targetpool_init();
+	targetbatch_init();
 	targetset_ml_init();
 #ifndef GENERATE_INIT
 #include "target_init.c"
@@ -13,19 +13,32 @@
 
 struct target_t {
 	const ml_type_t *Type;
-	target_t *PriorityAdjustNext, *Parent;
+	target_t *Parent;
+	struct targetqueue_t *Queue;
+	struct targetpool_t *Pool;
+	struct targetbatch_t *Batch;
+	target_t *PoolNext;
 	ml_value_t *Build;
 	struct context_t *BuildContext;
 	const char *Id;
 	target_t *Waiting;
+	struct target_waiter_t *Waiters;
 	targetset_t Affects[1];
 	targetset_t Depends[1];
 	targetset_t BuildDepends[1];
+	targetset_t *CachedDepends, *CachedScans;
 	size_t CacheIndex;
 	int WaitCount;
 	int LastUpdated;
 	int IdLength;
-	int QueueIndex, QueuePriority;
+	int QueueIndex, QueuePriority, PriorityRaising;
+	int Duration, Weight;
+	int Failed;
+	int Fork;
+	int Suspended;
+	int Timer;
+	int64_t ActiveTime;
+	struct timespec ActiveSince;
 	unsigned long IdHash;
 	unsigned char Hash[SHA256_BLOCK_SIZE];
 };
@@ -39,7 +52,11 @@ extern int ProgressBar;
 extern int MonitorFiles;
 extern int DebugThreads;
 extern int WatchMode;
+extern int KeepGoing;
+extern double MaxLoad;
+extern long MemoryReserve;
 extern FILE *DependencyGraph;
+extern FILE *BuildTrace;
 extern pthread_mutex_t InterpreterLock[1];
 extern ml_type_t TargetT[];
 
@@ -60,16 +77,34 @@ ml_value_t *target_depends_auto_value(void *Data, int Count, ml_value_t **Args);
 
 void target_depends_add(target_t *Target, target_t *Depend);
 void target_depends_auto(target_t *Depend);
+void target_depends_auto_allx(ml_state_t *Caller, targetset_t *Depends);
 target_t *target_find(const char *Id);
 target_t *target_create(const char *Id);
 target_t *target_load(const char *Id, size_t Index, target_t **Slot);
 void target_push(target_t *Target);
 target_t *target_file_check(const char *Path, int Absolute);
 void target_threads_start(int NumThreads);
+void target_threads_adapt(int NumCpus, int Limit);
 void target_threads_wait();
+int target_failures_report(void);
 void target_interactive_start(int NumThreads);
 
+typedef void (*target_value_fn)(ml_state_t *Caller, target_t *Depend, ml_value_t **Args);
+
 int target_wait(target_t *Target, target_t *Waiter);
+void target_waitx(ml_state_t *Caller, target_t *Depend, target_value_fn Value, int Count, ml_value_t **Args);
+
+typedef struct target_resume_t target_resume_t;
+
+int target_suspendable(void);
+target_resume_t *target_suspend(ml_state_t *Caller, target_value_fn Value, int Count, ml_value_t **Args);
+void target_suspend_cancel(target_resume_t *Resume);
+void target_resume_later(target_resume_t *Resume);
+void target_resume_queue(target_resume_t *Resume);
+void target_wait_all(targetset_t *Set, target_t *Waiter);
+void target_batch_call(target_t *Scope, ml_state_t *Caller, ml_value_t *Function, ml_value_t *Targets);
+void target_timer_start(target_t *Target);
+int target_timer_stop(target_t *Target);
 int target_queue(target_t *Target, target_t *Parent);
 
 void display_threads();
@@ -11,6 +11,8 @@
 #include "rabs.h"
 #include "util.h"
 #include "targetcache.h"
+#include "targethash.h"
+#include "cache.h"
 #include "ml_file.h"
 
 #ifdef Linux
@@ -25,7 +27,7 @@ extern ml_value_t *ArgifyMethod;
 
 struct target_file_t {
 	target_t Base;
-	int Absolute;
+	int Absolute, Prefetched;
 	const char *Path;
 };
 
@@ -76,50 +78,120 @@ time_t target_file_hash(target_file_t *Target, time_t PreviousTime, unsigned cha
 		FileName = vfs_resolve(concat(RootPath, "/", Target->Path, NULL));
 	}
 	pthread_mutex_unlock(InterpreterLock);
-	struct stat Stat[1];
-	if (stat(FileName, Stat)) {
-		pthread_mutex_lock(InterpreterLock);
+	targethash_job_t *Job = targethash_get(Target->Base.CacheIndex, FileName, PreviousTime, PreviousHash);
+	pthread_mutex_lock(InterpreterLock);
+	switch (Job->Result) {
+	case HASH_OK:
+		memcpy(Target->Base.Hash, Job->Hash, SHA256_BLOCK_SIZE);
+		return Job->Stat->st_mtime;
+	case HASH_MISSING:
 		printf("\e[33mWarning: file does not exist: %s\e[0m\n", FileName);
 		targetset_foreach(Target->Base.Affects, NULL, target_file_affects_fn);
 		memset(Target->Base.Hash, 0xF0, SHA256_BLOCK_SIZE);
 		return 0;
+	case HASH_OPEN_ERROR:
+		fprintf(stderr, "\e[31mError: error opening: %s\e[0m\n", FileName);
+		targetset_foreach(Target->Base.Affects, NULL, target_file_affects_fn);
+		exit(1);
+	case HASH_READ_ERROR:
+		fprintf(stderr, "\e[31mError: error reading: %s\e[0m\n", FileName);
+		targetset_foreach(Target->Base.Affects, NULL, target_file_affects_fn);
+		exit(1);
 	}
-	if (Stat->st_mtime == PreviousTime) {
-		memcpy(Target->Base.Hash, PreviousHash, SHA256_BLOCK_SIZE);
-	} else if (S_ISDIR(Stat->st_mode)) {
-		memset(Target->Base.Hash, 0xD0, SHA256_BLOCK_SIZE);
-#if defined(__APPLE__)
-		memcpy(Target->Base.Hash, &Stat->st_mtimespec, sizeof(Stat->st_mtimespec));
-#elif defined(__MINGW32__)
-		memcpy(Target->Base.Hash, &Stat->st_mtime, sizeof(Stat->st_mtime));
-#else
-		memcpy(Target->Base.Hash, &Stat->st_mtim, sizeof(Stat->st_mtim));
-#endif
+	return 0;
+}
+
+int target_file_hash_later(target_file_t *Target, time_t PreviousTime, targethash_done_fn Done, void *Data) {
+	const char *FileName;
+	if (Target->Absolute) {
+		FileName = Target->Path;
 	} else {
-		int File = open(FileName, 0, O_RDONLY);
-		if (!File) {
-			fprintf(stderr, "\e[31mError: error opening: %s\e[0m\n", FileName);
-			targetset_foreach(Target->Base.Affects, NULL, target_file_affects_fn);
-			exit(1);
-		}
-		SHA256_CTX Ctx[1];
-		uint8_t Buffer[8192];
-		sha256_init(Ctx);
-		for (;;) {
-			int Count = read(File, Buffer, 8192);
-			if (Count == 0) break;
-			if (Count == -1) {
-				fprintf(stderr, "\e[31mError: error reading: %s\e[0m\n", FileName);
-				targetset_foreach(Target->Base.Affects, NULL, target_file_affects_fn);
-				exit(1);
-			}
-			sha256_update(Ctx, Buffer, Count);
-		}
+		FileName = vfs_resolve(concat(RootPath, "/", Target->Path, NULL));
+	}
+	return targethash_wait_later(Target->Base.CacheIndex, FileName, PreviousTime, Done, Data);
+}
+
+void target_file_prefetch(target_file_t *Target) {
+	if (!HashThreads && !ReadaheadThreads) return;
+	if (Target->Prefetched) return;
+	Target->Prefetched = 1;
+	const char *FileName;
+	if (Target->Absolute) {
+		FileName = Target->Path;
+	} else {
+		FileName = vfs_resolve(concat(RootPath, "/", Target->Path, NULL));
+	}
+	unsigned char PreviousHash[SHA256_BLOCK_SIZE];
+	int LastUpdated, LastChecked;
+	time_t PreviousTime = 0;
+	cache_hash_get((target_t *)Target, &LastUpdated, &LastChecked, &PreviousTime, PreviousHash);
+	// The hashing threads read changed files in turn, advising the kernel first lets it fetch them all in parallel
+	targethash_advise(FileName, PreviousTime);
+	if (HashThreads) targethash_submit(Target->Base.CacheIndex, FileName, PreviousTime, PreviousHash);
+}
+
+typedef struct target_file_source_t target_file_source_t;
+
+struct target_file_source_t {
+	target_file_source_t *Next;
+	const char *FileName;
+	size_t Index;
+	time_t FileTime;
+	unsigned char Hash[SHA256_BLOCK_SIZE];
+};
+
+// Collected while holding InterpreterLock, which protects the cache, and hashed by a background thread.
+static target_file_source_t *PrefetchSources = NULL;
+
+static int target_file_prefetch_source(target_file_source_t ***Tail, size_t Index, const char *Id, time_t FileTime, unsigned char Hash[SHA256_BLOCK_SIZE]) {
+	if (memcmp(Id, "file:", 5)) return 0;
+	target_file_source_t *Source = new(target_file_source_t);
+	Source->FileName = Id[5] == '/' ? Id + 5 : concat(RootPath, "/", Id + 5, NULL);
+	Source->Index = Index;
+	Source->FileTime = FileTime;
+	memcpy(Source->Hash, Hash, SHA256_BLOCK_SIZE);
+	Tail[0][0] = Source;
+	Tail[0] = &Source->Next;
+	return 0;
+}
+
+static void *target_file_prefetch_thread_fn(void *Arg) {
+	for (target_file_source_t *Source = PrefetchSources; Source; Source = Source->Next) {
+		// Resolved against the mounts defined so far (vfs_resolve only reads the mount list), a file that does not exist
+		// may be in a directory that is not mounted yet and is left for its target to submit.
+		const char *FileName = vfs_resolve(Source->FileName);
+		struct stat Stat[1];
+		if (stat(FileName, Stat) || !S_ISREG(Stat->st_mode)) continue;
+		if (!targethash_submit_speculative(Source->Index, FileName, Source->FileTime, Source->Hash)) break;
+#ifdef POSIX_FADV_WILLNEED
+		// Hashing does not read unchanged files, ask the kernel to read them ahead anyway since commands rebuilding
+		// the targets that depend on them are likely to read them next.
+		if (Stat->st_mtime != Source->FileTime) continue;
+		int File = open(FileName, O_RDONLY);
+		if (File < 0) continue;
+		posix_fadvise(File, 0, 0, POSIX_FADV_WILLNEED);
 		close(File);
-		sha256_final(Ctx, Target->Base.Hash);
+#endif
 	}
-	pthread_mutex_lock(InterpreterLock);
-	return Stat->st_mtime;
+	PrefetchSources = NULL;
+	return NULL;
+}
+
+void target_file_prefetch_cached_start() {
+	// Hashes source files from the previous build in the background while the build scripts are loading
+	if (!HashThreads) return;
+	target_file_source_t **Tail = &PrefetchSources;
+	cache_source_foreach(&Tail, (cache_source_fn)target_file_prefetch_source);
+	if (!PrefetchSources) return;
+	targethash_speculate(1);
+	pthread_t Thread;
+	pthread_create(&Thread, NULL, target_file_prefetch_thread_fn, NULL);
+	pthread_detach(Thread);
+}
+
+void target_file_prefetch_cached_stop() {
+	// Once targets are being queued they are prefetched as needed, no job is submitted from the cache after this returns
+	targethash_speculate(0);
 }
 
 int target_file_missing(target_file_t *Target) {
@@ -262,7 +334,10 @@ static int target_file_ls_fn(target_file_ls_t *Ls, const char *Base) {
 					File = target_file_check(Path, 1);
 				}
 				if (Ls->FilterFn) {
+					target_t *OldSuspend = SuspendTarget;
+					SuspendTarget = NULL;
 					ml_value_t *Result = ml_simple_inline(Ls->FilterFn, 1, File);
+					SuspendTarget = OldSuspend;
 					if (ml_is_error(Result)) {
 						Ls->Results = Result;
 						return 1;
@@ -3,6 +3,7 @@
 
 #include "target.h"
 #include "context.h"
+#include "targethash.h"
 
 typedef struct target_file_t target_file_t;
 
@@ -11,6 +12,10 @@ extern ml_type_t FileT[];
 void target_file_init();
 
 time_t target_file_hash(target_file_t *Target, time_t PreviousTime, unsigned char PreviousHash[SHA256_BLOCK_SIZE]);
+int target_file_hash_later(target_file_t *Target, time_t PreviousTime, targethash_done_fn Done, void *Data);
+void target_file_prefetch(target_file_t *Target);
+void target_file_prefetch_cached_start();
+void target_file_prefetch_cached_stop();
 int target_file_missing(target_file_t *Target);
 void target_file_watch(target_file_t *Target);
 
@@ -93,15 +93,16 @@ target_t *target_scan_create(const char *Id, context_t *BuildContext, size_t Ind
 	return (target_t *)Target;
 }
 
-ML_METHOD("scans", ScanT) {
+static void target_scan_scans(ml_state_t *Caller, target_t *Target, ml_value_t **Args) {
+	ML_RETURN(cache_scan_get(Target));
+}
+
+ML_METHODX("scans", ScanT) {
 //<Target
 //>targetset
 // Returns the results of the last scan.
 	target_t *Target = (target_t *)Args[0];
-	target_depends_auto((target_t *)Target);
-	target_queue((target_t *)Target, CurrentTarget);
-	target_wait((target_t *)Target, CurrentTarget);
-	return (ml_value_t *)cache_scan_get(Target);
+	return target_waitx(Caller, Target, target_scan_scans, 0, NULL);
 }
 
 void target_scan_init() {
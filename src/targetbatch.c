@@ -0,0 +1,210 @@
+#include "targetbatch.h"
+#include "target.h"
+#include "context.h"
+#include "stringmap.h"
+#include "ml_macros.h"
+#include <gc/gc.h>
+
+#undef ML_CATEGORY
+#define ML_CATEGORY "batch"
+
+// Batches combine the build functions of many small targets (e.g. compiling or archiving single files) into one call.
+// Members wait in their batch until it is full, its delay has passed or the thread adding members runs out of ready targets,
+// then the batch function is called once with the list of members. All batch state is protected by InterpreterLock.
+
+struct targetbatch_member_t {
+	targetbatch_member_t *Next;
+	target_t *Target;
+	ml_state_t *Caller;
+};
+
+static stringmap_t Batches[1] = {STRINGMAP_INIT};
+static targetbatch_t *PendingBatches = NULL;
+
+ML_FUNCTION(Batch) {
+//<Name:string
+//<Function?:function
+//<Limit?:integer
+//<Delay?:integer
+//>batch
+// Returns the batch named :mini:`Name`, creating it if necessary. Targets added to the batch with :mini:`Target:batch(Batch)` are built together by calling :mini:`Function(Targets)` once with a list of targets.
+// At most :mini:`Limit` targets (default 64) are built by each call. If :mini:`Delay` is provided, a partial batch is built once its first target has waited :mini:`Delay` milliseconds, otherwise it is built when no other targets are ready.
+	ML_CHECK_ARG_COUNT(1);
+	ML_CHECK_ARG_TYPE(0, MLStringT);
+	const char *Name = ml_string_value(Args[0]);
+	targetbatch_t **Slot = (targetbatch_t **)stringmap_slot(Batches, Name);
+	if (!Slot[0]) {
+		targetbatch_t *Batch = Slot[0] = new(targetbatch_t);
+		Batch->Type = TargetBatchT;
+		Batch->Name = Name;
+		Batch->MembersTail = &Batch->Members;
+		Batch->Limit = 64;
+	}
+	targetbatch_t *Batch = Slot[0];
+	if (Count > 1) Batch->Function = Args[1];
+	if (Count > 2) {
+		ML_CHECK_ARG_TYPE(2, MLIntegerT);
+		int Limit = ml_integer_value(Args[2]);
+		if (Limit < 1) return ml_error("ValueError", "Batch limit must be positive");
+		Batch->Limit = Limit;
+	}
+	if (Count > 3) {
+		ML_CHECK_ARG_TYPE(3, MLIntegerT);
+		int Delay = ml_integer_value(Args[3]);
+		if (Delay < 0) return ml_error("ValueError", "Batch delay must not be negative");
+		Batch->Delay = Delay;
+	}
+	if (!Batch->Function) return ml_error("ValueError", "Batch %s has no function", Name);
+	return (ml_value_t *)Batch;
+}
+
+ML_TYPE(TargetBatchT, (), "batch",
+// A named batch building several targets with a single call.
+	.Constructor = (ml_value_t *)Batch
+);
+
+ML_METHOD("name", TargetBatchT) {
+//<Batch
+//>string
+// Returns the name of :mini:`Batch`.
+	targetbatch_t *Batch = (targetbatch_t *)Args[0];
+	return ml_string(Batch->Name, -1);
+}
+
+ML_METHOD("limit", TargetBatchT) {
+//<Batch
+//>integer
+// Returns the maximum number of targets built by each call of the function of :mini:`Batch`.
+	targetbatch_t *Batch = (targetbatch_t *)Args[0];
+	return ml_integer(Batch->Limit);
+}
+
+typedef struct {
+	ml_state_t Base;
+	targetbatch_member_t *Members;
+	targetset_t Recorded[1];
+	int Count;
+} targetbatch_call_t;
+
+static int targetbatch_depend(target_t *Depend, target_t *Target) {
+	if (Depend != Target) targetset_insert(Target->BuildDepends, Depend);
+	return 0;
+}
+
+static void targetbatch_done(targetbatch_call_t *Call, ml_value_t *Result) {
+	// Each member is recorded as taking an equal share of the call so priorities stay comparable with unbatched targets.
+	target_t *Scope = Call->Members->Target;
+	int Share = target_timer_stop(Scope) / Call->Count;
+	// The first member recorded the dependencies of the call, restore its own and give every member all of them.
+	targetset_t Recorded[1] = {Scope->BuildDepends[0]};
+	Scope->BuildDepends[0] = Call->Recorded[0];
+	for (targetbatch_member_t *Member = Call->Members; Member; Member = Member->Next) {
+		targetset_foreach(Recorded, Member->Target, (void *)targetbatch_depend);
+	}
+	for (targetbatch_member_t *Member = Call->Members; Member; Member = Member->Next) {
+		Member->Target->Duration = Share;
+		Member->Caller->run(Member->Caller, Result);
+	}
+}
+
+static void targetbatch_call(targetbatch_t *Batch, targetbatch_member_t *Members, int Count) {
+	// All members share the same build context. The first member stands in for the others while the function runs,
+	// it waits for any targets used and collects them in an empty set of build dependencies.
+	// The call may suspend, targetbatch_done then runs later on whichever thread resumes it.
+	targetbatch_call_t *Call = new(targetbatch_call_t);
+	Call->Base.run = (ml_state_fn)targetbatch_done;
+	Call->Base.Context = MLRootContext;
+	Call->Members = Members;
+	Call->Count = Count;
+	target_t *Scope = Members->Target;
+	Call->Recorded[0] = Scope->BuildDepends[0];
+	Scope->BuildDepends[0] = (targetset_t)TARGETSET_INIT;
+	ml_value_t *Targets = ml_list();
+	for (targetbatch_member_t *Member = Members; Member; Member = Member->Next) {
+		ml_list_put(Targets, (ml_value_t *)Member->Target);
+	}
+	// Timed on the first member so time spent waiting for other targets is left out, as for single builds
+	target_batch_call(Scope, (ml_state_t *)Call, Batch->Function, Targets);
+}
+
+static void targetbatch_flush(targetbatch_t *Batch) {
+	targetbatch_t **Slot = &PendingBatches;
+	while (Slot[0] != Batch) Slot = &Slot[0]->NextPending;
+	Slot[0] = Batch->NextPending;
+	Batch->NextPending = NULL;
+	targetbatch_member_t *Members = Batch->Members;
+	Batch->Members = NULL;
+	Batch->MembersTail = &Batch->Members;
+	Batch->Count = 0;
+	// Members added from different contexts are built by separate calls, each in the context of its members.
+	while (Members) {
+		context_t *Context = Members->Target->BuildContext;
+		targetbatch_member_t *Group = NULL, **GroupTail = &Group;
+		targetbatch_member_t *Rest = NULL, **RestTail = &Rest;
+		int Count = 0;
+		for (targetbatch_member_t *Member = Members, *Next; Member; Member = Next) {
+			Next = Member->Next;
+			if (Member->Target->BuildContext == Context) {
+				GroupTail[0] = Member;
+				GroupTail = &Member->Next;
+				++Count;
+			} else {
+				RestTail[0] = Member;
+				RestTail = &Member->Next;
+			}
+		}
+		GroupTail[0] = NULL;
+		RestTail[0] = NULL;
+		targetbatch_call(Batch, Group, Count);
+		Members = Rest;
+	}
+}
+
+void targetbatch_add(targetbatch_t *Batch, target_t *Target, ml_state_t *Caller) {
+	// Caller is resumed with the result of the batch function once the batch is built.
+	targetbatch_member_t *Member = new(targetbatch_member_t);
+	Member->Target = Target;
+	Member->Caller = Caller;
+	Batch->MembersTail[0] = Member;
+	Batch->MembersTail = &Member->Next;
+	if (Batch->Count++ == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &Batch->First);
+		Batch->NextPending = PendingBatches;
+		PendingBatches = Batch;
+	}
+	if (Batch->Count >= Batch->Limit) targetbatch_flush(Batch);
+}
+
+int targetbatch_flush_expired() {
+	if (!PendingBatches) return 0;
+	struct timespec Now;
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	int Flushed = 0;
+	targetbatch_t *Batch = PendingBatches;
+	while (Batch) {
+		targetbatch_t *Next = Batch->NextPending;
+		long Waited = (Now.tv_sec - Batch->First.tv_sec) * 1000 + (Now.tv_nsec - Batch->First.tv_nsec) / 1000000;
+		if (Batch->Delay && Waited >= Batch->Delay) {
+			targetbatch_flush(Batch);
+			Flushed = 1;
+			// Flushing may have added or flushed other batches, start again
+			Next = PendingBatches;
+			clock_gettime(CLOCK_MONOTONIC, &Now);
+		}
+		Batch = Next;
+	}
+	return Flushed;
+}
+
+int targetbatch_flush_pending() {
+	// Called before a thread goes idle or blocks, nothing else would build the waiting members.
+	if (!PendingBatches) return 0;
+	while (PendingBatches) targetbatch_flush(PendingBatches);
+	return 1;
+}
+
+void targetbatch_init() {
+#ifndef GENERATE_INIT
+#include "targetbatch_init.c"
+#endif
+}
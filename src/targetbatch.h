@@ -0,0 +1,29 @@
+#ifndef TARGETBATCH_H
+#define TARGETBATCH_H
+
+#include <time.h>
+#include "minilang.h"
+
+typedef struct target_t target_t;
+typedef struct targetbatch_t targetbatch_t;
+typedef struct targetbatch_member_t targetbatch_member_t;
+
+struct targetbatch_t {
+	const ml_type_t *Type;
+	const char *Name;
+	ml_value_t *Function;
+	targetbatch_member_t *Members, **MembersTail;
+	targetbatch_t *NextPending;
+	struct timespec First;
+	int Limit, Delay, Count;
+};
+
+extern ml_type_t TargetBatchT[];
+
+void targetbatch_init();
+
+void targetbatch_add(targetbatch_t *Batch, target_t *Target, ml_state_t *Caller);
+int targetbatch_flush_expired();
+int targetbatch_flush_pending();
+
+#endif
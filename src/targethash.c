@@ -0,0 +1,303 @@
+#include "targethash.h"
+#include "ml_macros.h"
+#include <gc/gc.h>
+#include <pthread.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+enum {
+	JOB_PENDING,
+	JOB_RUNNING,
+	JOB_DONE
+};
+
+int HashThreads = 0;
+
+static pthread_mutex_t HashLock[1] = {PTHREAD_MUTEX_INITIALIZER};
+static pthread_cond_t HashAvailable[1] = {PTHREAD_COND_INITIALIZER};
+static pthread_cond_t HashDone[1] = {PTHREAD_COND_INITIALIZER};
+
+static targethash_job_t *QueueHead = NULL, *QueueTail = NULL;
+static targethash_job_t **Jobs = NULL;
+static size_t JobsSize = 0;
+
+// Files are stat'ed (and read ahead if changed) in the background, so without hashing threads the build threads
+// do not wait on each round trip in turn, and with them changed files are fetched in parallel before they are hashed.
+#define READAHEAD_THREADS 4
+
+typedef struct targethash_advice_t targethash_advice_t;
+
+struct targethash_advice_t {
+	targethash_advice_t *Next;
+	const char *FileName;
+	time_t PreviousTime;
+};
+
+int ReadaheadThreads = 0;
+
+static pthread_cond_t AdviceAvailable[1] = {PTHREAD_COND_INITIALIZER};
+static targethash_advice_t *AdviceHead = NULL, *AdviceTail = NULL;
+
+static void targethash_compute(targethash_job_t *Job) {
+	struct stat *Stat = Job->Stat;
+	if (stat(Job->FileName, Stat)) {
+		Job->Result = HASH_MISSING;
+		return;
+	}
+	if (Stat->st_mtime == Job->PreviousTime) {
+		memcpy(Job->Hash, Job->PreviousHash, SHA256_BLOCK_SIZE);
+	} else if (S_ISDIR(Stat->st_mode)) {
+		memset(Job->Hash, 0xD0, SHA256_BLOCK_SIZE);
+#if defined(__APPLE__)
+		memcpy(Job->Hash, &Stat->st_mtimespec, sizeof(Stat->st_mtimespec));
+#elif defined(__MINGW32__)
+		memcpy(Job->Hash, &Stat->st_mtime, sizeof(Stat->st_mtime));
+#else
+		memcpy(Job->Hash, &Stat->st_mtim, sizeof(Stat->st_mtim));
+#endif
+	} else {
+		int File = open(Job->FileName, O_RDONLY);
+		if (File < 0) {
+			Job->Result = HASH_OPEN_ERROR;
+			return;
+		}
+		SHA256_CTX Ctx[1];
+		uint8_t Buffer[8192];
+		sha256_init(Ctx);
+		for (;;) {
+			int Count = read(File, Buffer, 8192);
+			if (Count == 0) break;
+			if (Count == -1) {
+				close(File);
+				Job->Result = HASH_READ_ERROR;
+				return;
+			}
+			sha256_update(Ctx, Buffer, Count);
+		}
+		close(File);
+		sha256_final(Ctx, Job->Hash);
+	}
+	Job->Result = HASH_OK;
+}
+
+static int targethash_stat_equal(struct stat *A, struct stat *B) {
+	if (A->st_dev != B->st_dev) return 0;
+	if (A->st_ino != B->st_ino) return 0;
+	if (A->st_size != B->st_size) return 0;
+#if defined(__APPLE__)
+	return !memcmp(&A->st_mtimespec, &B->st_mtimespec, sizeof(A->st_mtimespec));
+#elif defined(__MINGW32__)
+	return A->st_mtime == B->st_mtime;
+#else
+	return !memcmp(&A->st_mtim, &B->st_mtim, sizeof(A->st_mtim));
+#endif
+}
+
+static targethash_job_t *targethash_job(const char *FileName, time_t PreviousTime, unsigned char PreviousHash[SHA256_BLOCK_SIZE]) {
+	targethash_job_t *Job = new(targethash_job_t);
+	Job->FileName = FileName;
+	Job->PreviousTime = PreviousTime;
+	Job->State = JOB_PENDING;
+	memcpy(Job->PreviousHash, PreviousHash, SHA256_BLOCK_SIZE);
+	return Job;
+}
+
+static void *targethash_thread_fn(void *Arg) {
+	pthread_mutex_lock(HashLock);
+	for (;;) {
+		targethash_job_t *Job = QueueHead;
+		if (!Job) {
+			pthread_cond_wait(HashAvailable, HashLock);
+			continue;
+		}
+		if (!(QueueHead = Job->Next)) QueueTail = NULL;
+		Job->Next = NULL;
+		// Jobs may already have been claimed by a build thread
+		if (Job->State != JOB_PENDING) continue;
+		Job->State = JOB_RUNNING;
+		pthread_mutex_unlock(HashLock);
+		targethash_compute(Job);
+		pthread_mutex_lock(HashLock);
+		Job->State = JOB_DONE;
+		pthread_cond_broadcast(HashDone);
+		targethash_done_fn Done = Job->Done;
+		if (Done) {
+			Job->Done = NULL;
+			pthread_mutex_unlock(HashLock);
+			Done(Job->Data);
+			pthread_mutex_lock(HashLock);
+		}
+	}
+	return NULL;
+}
+
+static void *targethash_advice_thread_fn(void *Arg) {
+	pthread_mutex_lock(HashLock);
+	for (;;) {
+		targethash_advice_t *Advice = AdviceHead;
+		if (!Advice) {
+			pthread_cond_wait(AdviceAvailable, HashLock);
+			continue;
+		}
+		if (!(AdviceHead = Advice->Next)) AdviceTail = NULL;
+		pthread_mutex_unlock(HashLock);
+		struct stat Stat[1];
+		// Unchanged files are not read when hashing, only warm the page cache for changed ones
+		if (!stat(Advice->FileName, Stat) && S_ISREG(Stat->st_mode) && Stat->st_mtime != Advice->PreviousTime) {
+			int File = open(Advice->FileName, O_RDONLY);
+			if (File >= 0) {
+				posix_fadvise(File, 0, 0, POSIX_FADV_WILLNEED);
+				close(File);
+			}
+		}
+		pthread_mutex_lock(HashLock);
+	}
+	return NULL;
+}
+
+void targethash_init(int NumThreads) {
+	HashThreads = NumThreads;
+	for (int I = 0; I < NumThreads; ++I) {
+		pthread_t Thread;
+		pthread_create(&Thread, NULL, targethash_thread_fn, NULL);
+		pthread_detach(Thread);
+	}
+#ifdef POSIX_FADV_WILLNEED
+	ReadaheadThreads = READAHEAD_THREADS;
+	for (int I = 0; I < ReadaheadThreads; ++I) {
+		pthread_t Thread;
+		pthread_create(&Thread, NULL, targethash_advice_thread_fn, NULL);
+		pthread_detach(Thread);
+	}
+#endif
+}
+
+void targethash_advise(const char *FileName, time_t PreviousTime) {
+	if (!ReadaheadThreads) return;
+	targethash_advice_t *Advice = new(targethash_advice_t);
+	Advice->FileName = FileName;
+	Advice->PreviousTime = PreviousTime;
+	pthread_mutex_lock(HashLock);
+	if (AdviceTail) {
+		AdviceTail->Next = Advice;
+	} else {
+		AdviceHead = Advice;
+	}
+	AdviceTail = Advice;
+	pthread_cond_signal(AdviceAvailable);
+	pthread_mutex_unlock(HashLock);
+}
+
+void targethash_fork_child() {
+	// Pending jobs would never complete without the hashing threads, hash everything inline instead
+	pthread_mutex_init(HashLock, NULL);
+	HashThreads = 0;
+	ReadaheadThreads = 0;
+	AdviceHead = AdviceTail = NULL;
+	QueueHead = QueueTail = NULL;
+	Jobs = NULL;
+	JobsSize = 0;
+}
+
+static void targethash_queue(size_t Index, const char *FileName, time_t PreviousTime, unsigned char PreviousHash[SHA256_BLOCK_SIZE]) {
+	// Must be called with HashLock held
+	targethash_job_t *Job = targethash_job(FileName, PreviousTime, PreviousHash);
+	if (Index >= JobsSize) {
+		size_t NewJobsSize = JobsSize ?: 1024;
+		while (Index >= NewJobsSize) NewJobsSize *= 2;
+		targethash_job_t **NewJobs = anew(targethash_job_t *, NewJobsSize);
+		if (Jobs) memcpy(NewJobs, Jobs, JobsSize * sizeof(targethash_job_t *));
+		Jobs = NewJobs;
+		JobsSize = NewJobsSize;
+	}
+	Jobs[Index] = Job;
+	if (QueueTail) {
+		QueueTail->Next = Job;
+	} else {
+		QueueHead = Job;
+	}
+	QueueTail = Job;
+	pthread_cond_signal(HashAvailable);
+}
+
+void targethash_submit(size_t Index, const char *FileName, time_t PreviousTime, unsigned char PreviousHash[SHA256_BLOCK_SIZE]) {
+	if (!HashThreads) return;
+	pthread_mutex_lock(HashLock);
+	targethash_job_t *Job = Index < JobsSize ? Jobs[Index] : NULL;
+	if (Job && Job->PreviousTime == PreviousTime && !strcmp(Job->FileName, FileName)) {
+		// Already submitted speculatively from the cache
+		pthread_mutex_unlock(HashLock);
+		return;
+	}
+	targethash_queue(Index, FileName, PreviousTime, PreviousHash);
+	pthread_mutex_unlock(HashLock);
+}
+
+// Speculative jobs are submitted from the cache before targets exist, only until targethash_speculate(0).
+static int Speculating = 0;
+
+void targethash_speculate(int Enabled) {
+	pthread_mutex_lock(HashLock);
+	Speculating = Enabled;
+	pthread_mutex_unlock(HashLock);
+}
+
+int targethash_submit_speculative(size_t Index, const char *FileName, time_t PreviousTime, unsigned char PreviousHash[SHA256_BLOCK_SIZE]) {
+	// Never replaces a job, any job for Index was submitted by the build itself. Returns 0 once speculation has stopped.
+	if (!HashThreads) return 0;
+	pthread_mutex_lock(HashLock);
+	int Enabled = Speculating;
+	if (Enabled && !(Index < JobsSize && Jobs[Index])) targethash_queue(Index, FileName, PreviousTime, PreviousHash);
+	pthread_mutex_unlock(HashLock);
+	return Enabled;
+}
+
+int targethash_wait_later(size_t Index, const char *FileName, time_t PreviousTime, targethash_done_fn Done, void *Data) {
+	// If the job for FileName is being hashed by a hashing thread, arranges for Done(Data) to be called from that thread once it
+	// finishes and returns 1, targethash_get() then returns the finished job without waiting. Returns 0 otherwise, without calling Done.
+	pthread_mutex_lock(HashLock);
+	targethash_job_t *Job = Index < JobsSize ? Jobs[Index] : NULL;
+	int Later = Job && Job->State == JOB_RUNNING && !Job->Done && Job->PreviousTime == PreviousTime && !strcmp(Job->FileName, FileName);
+	if (Later) {
+		Job->Done = Done;
+		Job->Data = Data;
+	}
+	pthread_mutex_unlock(HashLock);
+	return Later;
+}
+
+targethash_job_t *targethash_get(size_t Index, const char *FileName, time_t PreviousTime, unsigned char PreviousHash[SHA256_BLOCK_SIZE]) {
+	targethash_job_t *Job = NULL;
+	pthread_mutex_lock(HashLock);
+	if (Index < JobsSize) {
+		Job = Jobs[Index];
+		Jobs[Index] = NULL;
+	}
+	if (Job && (Job->PreviousTime != PreviousTime || strcmp(Job->FileName, FileName))) Job = NULL;
+	if (!Job) {
+		pthread_mutex_unlock(HashLock);
+		Job = targethash_job(FileName, PreviousTime, PreviousHash);
+		targethash_compute(Job);
+		return Job;
+	}
+	if (Job->State == JOB_PENDING) {
+		// Not started yet, hash it here rather than waiting behind other jobs
+		Job->State = JOB_RUNNING;
+		pthread_mutex_unlock(HashLock);
+		targethash_compute(Job);
+		return Job;
+	}
+	while (Job->State != JOB_DONE) pthread_cond_wait(HashDone, HashLock);
+	pthread_mutex_unlock(HashLock);
+	// The file may have changed since it was hashed in the background
+	struct stat Stat[1];
+	if (stat(FileName, Stat)) {
+		if (Job->Result == HASH_MISSING) return Job;
+	} else if (Job->Result != HASH_MISSING && targethash_stat_equal(Stat, Job->Stat)) {
+		return Job;
+	}
+	Job = targethash_job(FileName, PreviousTime, PreviousHash);
+	targethash_compute(Job);
+	return Job;
+}
@@ -0,0 +1,44 @@
+#ifndef TARGETHASH_H
+#define TARGETHASH_H
+
+#include <time.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "sha256.h"
+
+typedef enum {
+	HASH_OK,
+	HASH_MISSING,
+	HASH_OPEN_ERROR,
+	HASH_READ_ERROR
+} targethash_result_t;
+
+typedef struct targethash_job_t targethash_job_t;
+
+typedef void (*targethash_done_fn)(void *Data);
+
+struct targethash_job_t {
+	targethash_job_t *Next;
+	const char *FileName;
+	time_t PreviousTime;
+	int State;
+	targethash_result_t Result;
+	targethash_done_fn Done;
+	void *Data;
+	struct stat Stat[1];
+	unsigned char PreviousHash[SHA256_BLOCK_SIZE];
+	unsigned char Hash[SHA256_BLOCK_SIZE];
+};
+
+extern int HashThreads, ReadaheadThreads;
+
+void targethash_init(int NumThreads);
+void targethash_advise(const char *FileName, time_t PreviousTime);
+void targethash_fork_child();
+void targethash_submit(size_t Index, const char *FileName, time_t PreviousTime, unsigned char PreviousHash[SHA256_BLOCK_SIZE]);
+void targethash_speculate(int Enabled);
+int targethash_submit_speculative(size_t Index, const char *FileName, time_t PreviousTime, unsigned char PreviousHash[SHA256_BLOCK_SIZE]);
+int targethash_wait_later(size_t Index, const char *FileName, time_t PreviousTime, targethash_done_fn Done, void *Data);
+targethash_job_t *targethash_get(size_t Index, const char *FileName, time_t PreviousTime, unsigned char PreviousHash[SHA256_BLOCK_SIZE]);
+
+#endif
@@ -0,0 +1,117 @@
+#include "targetpool.h"
+#include "target.h"
+#include "stringmap.h"
+#include "ml_macros.h"
+#include <gc/gc.h>
+
+#undef ML_CATEGORY
+#define ML_CATEGORY "pool"
+
+// Pools limit how many build functions of a class of targets run at once.
+// Targets are deferred when dequeued from a full pool so the thread can build something else, and a build
+// waiting for other targets gives up its slot so targets it depends on in the same pool can run.
+// All pool state is protected by InterpreterLock.
+
+static stringmap_t Pools[1] = {STRINGMAP_INIT};
+
+ML_FUNCTION(Pool) {
+//<Name:string
+//<Limit?:integer
+//>pool
+// Returns the pool named :mini:`Name`, creating it if necessary. If :mini:`Limit` is provided, at most :mini:`Limit` build functions of targets in the pool will run at the same time.
+	ML_CHECK_ARG_COUNT(1);
+	ML_CHECK_ARG_TYPE(0, MLStringT);
+	const char *Name = ml_string_value(Args[0]);
+	targetpool_t **Slot = (targetpool_t **)stringmap_slot(Pools, Name);
+	if (!Slot[0]) {
+		targetpool_t *Pool = Slot[0] = new(targetpool_t);
+		Pool->Type = TargetPoolT;
+		Pool->Name = Name;
+		Pool->DeferredTail = &Pool->Deferred;
+		Pool->Limit = 1;
+	}
+	if (Count > 1) {
+		ML_CHECK_ARG_TYPE(1, MLIntegerT);
+		int Limit = ml_integer_value(Args[1]);
+		if (Limit < 1) return ml_error("ValueError", "Pool limit must be positive");
+		Slot[0]->Limit = Limit;
+	}
+	return (ml_value_t *)Slot[0];
+}
+
+ML_TYPE(TargetPoolT, (), "pool",
+// A named pool limiting the number of concurrently running build functions.
+	.Constructor = (ml_value_t *)Pool
+);
+
+ML_METHOD("name", TargetPoolT) {
+//<Pool
+//>string
+// Returns the name of :mini:`Pool`.
+	targetpool_t *Pool = (targetpool_t *)Args[0];
+	return ml_string(Pool->Name, -1);
+}
+
+ML_METHOD("limit", TargetPoolT) {
+//<Pool
+//>integer
+// Returns the maximum number of concurrent build functions in :mini:`Pool`.
+	targetpool_t *Pool = (targetpool_t *)Args[0];
+	return ml_integer(Pool->Limit);
+}
+
+int targetpool_full(target_t *Target) {
+	targetpool_t *Pool = Target->Pool;
+	return Pool && Pool->Running >= Pool->Limit;
+}
+
+int targetpool_defer(target_t *Target) {
+	if (!targetpool_full(Target)) return 0;
+	targetpool_t *Pool = Target->Pool;
+	Target->PoolNext = NULL;
+	Pool->DeferredTail[0] = Target;
+	Pool->DeferredTail = &Target->PoolNext;
+	return 1;
+}
+
+static void targetpool_undefer(targetpool_t *Pool, target_t *Target) {
+	// Target is only on the deferred list if it has a successor or is the last entry
+	if (!Target->PoolNext && Pool->DeferredTail != &Target->PoolNext) return;
+	target_t **Slot = &Pool->Deferred;
+	while (Slot[0] != Target) Slot = &Slot[0]->PoolNext;
+	if (!(Slot[0] = Target->PoolNext)) Pool->DeferredTail = Slot;
+	Target->PoolNext = NULL;
+}
+
+int targetpool_acquire(target_t *Target) {
+	// Only reached when a target is updated inline by a waiting thread or a slot was taken while its dependencies were checked.
+	// Never blocks, if the pool is full Target is deferred again and 0 is returned so the caller can leave it to the queue.
+	targetpool_t *Pool = Target->Pool;
+	targetpool_undefer(Pool, Target);
+	if (targetpool_defer(Target)) return 0;
+	++Pool->Running;
+	return 1;
+}
+
+void targetpool_resume(target_t *Target) {
+	// A build resuming after waiting for other targets takes its slot back even if the pool filled up meanwhile,
+	// holding it back could deadlock on targets that are waiting for this one.
+	++Target->Pool->Running;
+}
+
+target_t *targetpool_release(targetpool_t *Pool) {
+	// Returns the oldest deferred target (if any) which should be queued again.
+	--Pool->Running;
+	target_t *Target = Pool->Deferred;
+	if (Target) {
+		if (!(Pool->Deferred = Target->PoolNext)) Pool->DeferredTail = &Pool->Deferred;
+		Target->PoolNext = NULL;
+	}
+	return Target;
+}
+
+void targetpool_init() {
+#ifndef GENERATE_INIT
+#include "targetpool_init.c"
+#endif
+}
@@ -0,0 +1,26 @@
+#ifndef TARGETPOOL_H
+#define TARGETPOOL_H
+
+#include "minilang.h"
+
+typedef struct target_t target_t;
+typedef struct targetpool_t targetpool_t;
+
+struct targetpool_t {
+	const ml_type_t *Type;
+	const char *Name;
+	target_t *Deferred, **DeferredTail;
+	int Limit, Running;
+};
+
+extern ml_type_t TargetPoolT[];
+
+void targetpool_init();
+
+int targetpool_full(target_t *Target);
+int targetpool_defer(target_t *Target);
+int targetpool_acquire(target_t *Target);
+void targetpool_resume(target_t *Target);
+target_t *targetpool_release(targetpool_t *Pool);
+
+#endif
@@ -1,118 +1,308 @@
 #include "targetqueue.h"
+#include "cache.h"
+#include "rabs.h"
 #include "ml_macros.h"
 #include <gc/gc.h>
 #include <string.h>
+#include <time.h>
 
-target_t **QueueHeap = 0;
-target_t *PriorityAdjustQueue = 0;
-int QueueSize = 0;
-int QueueTop = 0;
+struct targetqueue_t {
+	target_t **Heap;
+	int Size, Top;
+};
+
+// Like the targets in them, all queues are protected by InterpreterLock, so per-thread queues do not reduce lock contention.
+// They keep targets made ready by a thread on that thread and let it take its next target without comparing against every
+// other thread. Other queues are only scanned when the own and shared queues are empty and StealableTargets is not zero.
+static targetqueue_t SharedQueue[1];
+static targetqueue_t **Queues = NULL;
+static int NumQueues = 0, MaxQueues = 0, StealableTargets = 0;
+
+double PriorityTime = 0;
+
+typedef struct {
+	target_t *Target;
+	int Index, Longest;
+} priority_frame_t;
+
+static priority_frame_t *PriorityStack = NULL;
+static int PriorityStackSize = 0;
 
 void targetqueue_init() {
-	QueueSize = 32;
-	QueueHeap = anew(target_t *, QueueSize);
+	SharedQueue->Size = 32;
+	SharedQueue->Heap = anew(target_t *, SharedQueue->Size);
+	PriorityStackSize = 64;
+	PriorityStack = anew(priority_frame_t, PriorityStackSize);
 }
 
-static void target_priority_compute(target_t *Target);
+targetqueue_t *targetqueue_new() {
+	targetqueue_t *Queue = new(targetqueue_t);
+	Queue->Size = 32;
+	Queue->Heap = anew(target_t *, Queue->Size);
+	if (NumQueues == MaxQueues) {
+		MaxQueues = MaxQueues ? 2 * MaxQueues : 8;
+		targetqueue_t **NewQueues = anew(targetqueue_t *, MaxQueues);
+		if (Queues) memcpy(NewQueues, Queues, NumQueues * sizeof(targetqueue_t *));
+		Queues = NewQueues;
+	}
+	Queues[NumQueues++] = Queue;
+	return Queue;
+}
 
-static int targetqueue_priority_fn(target_t *Target, int *Total) {
-	if (Target->QueuePriority == PRIORITY_INVALID) target_priority_compute(Target);
-	*Total += Target->QueuePriority;
-	return 0;
+static inline void priority_push(int *Top, target_t *Target) {
+	if (*Top == PriorityStackSize) {
+		int NewSize = 2 * PriorityStackSize;
+		priority_frame_t *NewStack = anew(priority_frame_t, NewSize);
+		memcpy(NewStack, PriorityStack, PriorityStackSize * sizeof(priority_frame_t));
+		PriorityStack = NewStack;
+		PriorityStackSize = NewSize;
+	}
+	PriorityStack[*Top].Target = Target;
+	PriorityStack[*Top].Index = 0;
+	PriorityStack[*Top].Longest = 0;
+	++*Top;
 }
 
-static void target_priority_compute(target_t *Target) {
-	Target->QueuePriority = 1;
-	targetset_foreach(Target->Affects, &Target->QueuePriority, (void *)targetqueue_priority_fn);
+static inline double priority_clock() {
+	struct timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return Time.tv_sec + Time.tv_nsec / 1e9;
 }
 
-void targetqueue_insert(target_t *Target) {
-	if (Target->QueuePriority == PRIORITY_INVALID) target_priority_compute(Target);
-	if (QueueTop == QueueSize) {
-		int NewHeapSize = QueueSize * 2;
-		target_t **NewHeap = anew(target_t *, NewHeapSize);
-		memcpy(NewHeap, QueueHeap, QueueSize * sizeof(target_t *));
-		QueueHeap = NewHeap;
-		QueueSize = NewHeapSize;
+static inline int target_priority_cost(target_t *Target) {
+	// Weight is set by build scripts to start known slow targets earlier, in the same units as Duration
+	return Target->Duration + Target->Weight + 1;
+}
+
+static void target_priority_compute(target_t *Target) {
+	// Priority is the length of the longest path from Target to a requested target, weighted by the last recorded build durations (in ms)
+	// plus any weights set by the build scripts.
+	// Computed in a single depth first pass over Affects without recursion, results are kept so each target is only visited once.
+	// Pending targets are on the current path, i.e. part of a recursive dependency, which is reported elsewhere so they are ignored here.
+	int Top = 0;
+	Target->QueuePriority = PRIORITY_PENDING;
+	priority_push(&Top, Target);
+	while (Top) {
+		priority_frame_t *Frame = PriorityStack + Top - 1;
+		target_t *Next = Frame->Target;
+		targetset_t *Affects = Next->Affects;
+		while (Frame->Index < Affects->Size) {
+			target_t *Affect = Affects->Targets[Frame->Index++];
+			if (!Affect) continue;
+			if (Affect->QueuePriority == PRIORITY_INVALID) {
+				Affect->QueuePriority = PRIORITY_PENDING;
+				priority_push(&Top, Affect);
+				break;
+			}
+			if (Frame->Longest < Affect->QueuePriority) Frame->Longest = Affect->QueuePriority;
+		}
+		if (PriorityStack[Top - 1].Target != Next) continue;
+		if (Next->Duration < 0) Next->Duration = cache_duration_get(Next);
+		Next->QueuePriority = target_priority_cost(Next) + Frame->Longest;
+		if (--Top) {
+			Frame = PriorityStack + Top - 1;
+			if (Frame->Longest < Next->QueuePriority) Frame->Longest = Next->QueuePriority;
+		}
 	}
-	int Index = QueueTop++;
-	QueueHeap[Index] = Target;
+}
+
+static void targetqueue_sift_up(targetqueue_t *Queue, target_t *Target, int Index) {
+	target_t **Heap = Queue->Heap;
 	while (Index > 0) {
 		int ParentIndex = (Index - 1) / 2;
-		target_t *Parent = QueueHeap[ParentIndex];
-		if (Parent->QueuePriority >= Target->QueuePriority) {
-			Target->QueueIndex = Index;
-			return;
-		}
+		target_t *Parent = Heap[ParentIndex];
+		if (Parent->QueuePriority >= Target->QueuePriority) break;
 		Parent->QueueIndex = Index;
-		QueueHeap[Index] = Parent;
-		QueueHeap[ParentIndex] = Target;
+		Heap[Index] = Parent;
 		Index = ParentIndex;
 	}
+	Heap[Index] = Target;
+	Target->QueueIndex = Index;
+}
+
+static int target_priority_set(target_t *Target, int Priority) {
+	if (Priority <= Target->QueuePriority) return 0;
+	Target->QueuePriority = Priority;
+	// Priorities only increase so moving the target up its heap is enough
+	if (Target->QueueIndex >= 0) targetqueue_sift_up(Target->Queue, Target, Target->QueueIndex);
+	return 1;
 }
 
-void target_priority_invalidate(target_t *Target) {
-	if ((Target->QueueIndex >= 0) && (Target->QueuePriority > PRIORITY_INVALID)) {
-		Target->QueuePriority = PRIORITY_INVALID;
-		Target->PriorityAdjustNext = PriorityAdjustQueue;
-		PriorityAdjustQueue = Target;
+void target_priority_raise(target_t *Target, target_t *Waiter) {
+	// Target has gained Waiter, push any increase in priority down through the targets it depends on.
+	// Targets without a computed priority are skipped, they will see the new path when they are computed.
+	if (Target->QueuePriority < 0) return;
+	double Start = priority_clock();
+	if (Waiter->QueuePriority < 0) target_priority_compute(Waiter);
+	int Top = 0;
+	if (target_priority_set(Target, target_priority_cost(Target) + Waiter->QueuePriority)) {
+		Target->PriorityRaising = 1;
+		priority_push(&Top, Target);
 	}
+	while (Top) {
+		priority_frame_t *Frame = PriorityStack + Top - 1;
+		target_t *Next = Frame->Target;
+		int Index = Frame->Index++;
+		targetset_t *Set = Next->Depends;
+		if (Index >= Set->Size) {
+			Index -= Set->Size;
+			Set = Next->BuildDepends;
+		}
+		if (Index >= Set->Size) {
+			Next->PriorityRaising = 0;
+			--Top;
+			continue;
+		}
+		target_t *Depend = Set->Targets[Index];
+		if (!Depend || Depend->QueuePriority < 0 || Depend->PriorityRaising) continue;
+		if (Depend->LastUpdated > 0) continue;
+		if (target_priority_set(Depend, target_priority_cost(Depend) + Next->QueuePriority)) {
+			Depend->PriorityRaising = 1;
+			priority_push(&Top, Depend);
+		}
+	}
+	PriorityTime += priority_clock() - Start;
 }
 
-static inline void targetqueue_adjust_queue() {
-	target_t *Target = PriorityAdjustQueue;
-	PriorityAdjustQueue = 0;
-	while (Target) {
-		if (Target->QueuePriority == PRIORITY_INVALID) {
-			target_priority_compute(Target);
-			int Index = Target->QueueIndex;
-			while (Index > 0) {
-				int ParentIndex = (Index - 1) / 2;
-				target_t *Parent = QueueHeap[ParentIndex];
-				if (Parent->QueuePriority >= Target->QueuePriority) {
-					Target->QueueIndex = Index;
-					return;
-				}
-				Parent->QueueIndex = Index;
-				QueueHeap[Index] = Parent;
-				QueueHeap[ParentIndex] = Target;
-				Index = ParentIndex;
-			}
+static void targetqueue_reserve(targetqueue_t *Queue, int Count) {
+	if (Queue->Top + Count <= Queue->Size) return;
+	int NewHeapSize = Queue->Size * 2;
+	while (NewHeapSize < Queue->Top + Count) NewHeapSize *= 2;
+	target_t **NewHeap = anew(target_t *, NewHeapSize);
+	memcpy(NewHeap, Queue->Heap, Queue->Size * sizeof(target_t *));
+	Queue->Heap = NewHeap;
+	Queue->Size = NewHeapSize;
+}
+
+static void targetqueue_sift_down(targetqueue_t *Queue, int Index);
+
+void targetqueue_insert(target_t *Target) {
+	if (Target->QueuePriority < 0) {
+		double Start = priority_clock();
+		target_priority_compute(Target);
+		PriorityTime += priority_clock() - Start;
+	}
+	// Newly ready targets go to the queue of the thread that made them ready, idle threads steal from there.
+	targetqueue_t *Queue = (CurrentThread && CurrentThread->Queue) ? CurrentThread->Queue : SharedQueue;
+	targetqueue_reserve(Queue, 1);
+	Target->Queue = Queue;
+	targetqueue_sift_up(Queue, Target, Queue->Top++);
+	if (Queue != SharedQueue) ++StealableTargets;
+}
+
+void targetqueue_insert_all(target_t **Targets, int Count) {
+	if (!Count) return;
+	double Start = priority_clock();
+	for (int I = 0; I < Count; ++I) {
+		if (Targets[I]->QueuePriority < 0) target_priority_compute(Targets[I]);
+	}
+	PriorityTime += priority_clock() - Start;
+	targetqueue_t *Queue = (CurrentThread && CurrentThread->Queue) ? CurrentThread->Queue : SharedQueue;
+	targetqueue_reserve(Queue, Count);
+	if (Queue != SharedQueue) StealableTargets += Count;
+	if (Count < Queue->Top) {
+		for (int I = 0; I < Count; ++I) {
+			Targets[I]->Queue = Queue;
+			targetqueue_sift_up(Queue, Targets[I], Queue->Top++);
 		}
-		Target = Target->PriorityAdjustNext;
+		return;
+	}
+	// Large batches are appended and the whole heap rebuilt bottom up, which is linear instead of a sift per target
+	target_t **Heap = Queue->Heap;
+	for (int I = 0; I < Count; ++I) {
+		Targets[I]->Queue = Queue;
+		Targets[I]->QueueIndex = Queue->Top;
+		Heap[Queue->Top++] = Targets[I];
 	}
+	for (int Index = Queue->Top / 2 - 1; Index >= 0; --Index) targetqueue_sift_down(Queue, Index);
 }
 
-target_t *targetqueue_next() {
-	targetqueue_adjust_queue();
-	//printf("Queue state:\n");
-	//for (int Index = 0; Index < QueueTop; ++Index) printf("\t%d -> %d -> %s\n", Index, QueueHeap[Index]->QueuePriority, QueueHeap[Index]->Id);
-	target_t *Next = QueueHeap[0];
-	if (!Next) return 0;
-	Next->QueueIndex = -2;
-	int Index = 0;
-	target_t *Target = QueueHeap[--QueueTop];
-	QueueHeap[QueueTop] = 0;
-	if (!QueueTop) return Next;
+static void targetqueue_sift_down(targetqueue_t *Queue, int Index) {
+	target_t **Heap = Queue->Heap;
+	target_t *Target = Heap[Index];
+	int Top = Queue->Top;
 	for (;;) {
 		int Left = 2 * Index + 1;
 		int Right = 2 * Index + 2;
 		int Largest = Index;
-		QueueHeap[Index] = Target;
-		if (Left < QueueTop && QueueHeap[Left] && QueueHeap[Left]->QueuePriority > QueueHeap[Largest]->QueuePriority) {
+		Heap[Index] = Target;
+		if (Left < Top && Heap[Left] && Heap[Left]->QueuePriority > Heap[Largest]->QueuePriority) {
 			Largest = Left;
 		}
-		if (Right < QueueTop && QueueHeap[Right] && QueueHeap[Right]->QueuePriority > QueueHeap[Largest]->QueuePriority) {
+		if (Right < Top && Heap[Right] && Heap[Right]->QueuePriority > Heap[Largest]->QueuePriority) {
 			Largest = Right;
 		}
 		if (Largest != Index) {
-			target_t *Parent = QueueHeap[Largest];
-			QueueHeap[Index] = Parent;
+			target_t *Parent = Heap[Largest];
+			Heap[Index] = Parent;
 			Parent->QueueIndex = Index;
 			Index = Largest;
 		} else {
 			Target->QueueIndex = Index;
-			return Next;
+			return;
+		}
+	}
+}
+
+static void targetqueue_remove_at(targetqueue_t *Queue, int Index) {
+	target_t **Heap = Queue->Heap;
+	Heap[Index]->QueueIndex = -2;
+	if (Queue != SharedQueue) --StealableTargets;
+	target_t *Target = Heap[--Queue->Top];
+	Heap[Queue->Top] = 0;
+	if (Index == Queue->Top) return;
+	if (Index > 0 && Heap[(Index - 1) / 2]->QueuePriority < Target->QueuePriority) {
+		targetqueue_sift_up(Queue, Target, Index);
+		return;
+	}
+	Heap[Index] = Target;
+	targetqueue_sift_down(Queue, Index);
+}
+
+static target_t *targetqueue_pop(targetqueue_t *Queue) {
+	target_t *Next = Queue->Heap[0];
+	if (!Next) return 0;
+	targetqueue_remove_at(Queue, 0);
+	return Next;
+}
+
+void targetqueue_remove(target_t *Target) {
+	if (Target->QueueIndex >= 0) targetqueue_remove_at(Target->Queue, Target->QueueIndex);
+}
+
+target_t *targetqueue_next() {
+	targetqueue_t *Queue = (CurrentThread && CurrentThread->Queue) ? CurrentThread->Queue : SharedQueue;
+	target_t *Next = Queue->Heap[0];
+	target_t *Shared = SharedQueue->Heap[0];
+	if (Shared && (!Next || Shared->QueuePriority > Next->QueuePriority)) Queue = SharedQueue;
+	if (Queue->Top) return targetqueue_pop(Queue);
+	if (!StealableTargets) return 0;
+	// Nothing local, steal the highest priority target from another thread
+	targetqueue_t *Victim = NULL;
+	int Priority = PRIORITY_INVALID;
+	for (int I = 0; I < NumQueues; ++I) {
+		target_t *Top = Queues[I]->Heap[0];
+		if (Top && Top->QueuePriority > Priority) {
+			Victim = Queues[I];
+			Priority = Top->QueuePriority;
 		}
 	}
+	return Victim ? targetqueue_pop(Victim) : 0;
+}
+
+void targetqueue_free(targetqueue_t *Queue) {
+	// Called when a build thread exits, any targets still in its queue are moved to the shared queue.
+	for (int I = 0; I < NumQueues; ++I) {
+		if (Queues[I] == Queue) {
+			Queues[I] = Queues[--NumQueues];
+			Queues[NumQueues] = NULL;
+			break;
+		}
+	}
+	target_t *Target;
+	while ((Target = targetqueue_pop(Queue))) {
+		targetqueue_reserve(SharedQueue, 1);
+		Target->Queue = SharedQueue;
+		targetqueue_sift_up(SharedQueue, Target, SharedQueue->Top++);
+	}
 }
@@ -4,10 +4,19 @@
 #include "target.h"
 
 #define PRIORITY_INVALID -1
+#define PRIORITY_PENDING -2
+
+typedef struct targetqueue_t targetqueue_t;
 
 void targetqueue_init();
+targetqueue_t *targetqueue_new();
+void targetqueue_free(targetqueue_t *Queue);
 void targetqueue_insert(target_t *Target);
-void target_priority_invalidate(target_t *Target);
+void targetqueue_insert_all(target_t **Targets, int Count);
+void targetqueue_remove(target_t *Target);
+void target_priority_raise(target_t *Target, target_t *Waiter);
 target_t *targetqueue_next();
 
+extern double PriorityTime;
+
 #endif
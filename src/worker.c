@@ -0,0 +1,544 @@
+#include "worker.h"
+#include "rabs.h"
+#include "target.h"
+#include "jobserver.h"
+#include "process.h"
+#include "stringmap.h"
+#include "ml_macros.h"
+#include <gc/gc.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#undef ML_CATEGORY
+#define ML_CATEGORY "worker"
+
+// Workers are long running tool processes (e.g. code generators or compilers with a slow startup) that handle one request at a time.
+// Requests and responses are single lines of JSON on the worker's stdin and stdout, following the JSON form of Bazel's persistent
+// worker protocol: each request is {"arguments": [...], "inputs": [], "requestId": 0, "directory": "..."} and each response is
+// {"exitCode": N, "output": "..."}, where missing fields default to 0 and "". Worker state is protected by InterpreterLock.
+// Build functions are suspended while waiting for a process or a response, other callers release InterpreterLock and block.
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct worker_process_t {
+	worker_process_t *Next, *AllNext;
+	pid_t Pid;
+	int Fd;
+};
+
+struct worker_request_t {
+	worker_request_t *Next;
+	worker_t *Worker;
+	worker_process_t *Process;
+	target_resume_t *Resume;
+	const char *Chars;
+	char *Response;
+	size_t Length, ResponseLength, ResponseSize;
+	int Token;
+};
+
+int DefaultWorkerLimit = 1;
+
+static stringmap_t Workers[1] = {STRINGMAP_INIT};
+static worker_process_t *AllProcesses = NULL;
+static ml_value_t *ArgifyMethod;
+
+static ml_value_t *worker_argify(ml_value_t *ArgList, int Count, ml_value_t **Args) {
+	for (int I = 0; I < Count; ++I) {
+		ml_value_t *Result = ml_simple_inline(ArgifyMethod, 2, ArgList, Args[I]);
+		if (ml_is_error(Result)) return Result;
+	}
+	return ArgList;
+}
+
+ML_FUNCTION(Worker) {
+//<Name:string
+//<Command?:list
+//<Limit?:integer
+//>worker
+// Returns the worker named :mini:`Name`, creating it if necessary. :mini:`Command` is the command line (as for :mini:`execv()`) used to start each worker process in the project root directory.
+// At most :mini:`Limit` processes (default the number of threads given by :mini:`-p`) are started for the worker, each one is kept running until :mini:`rabs` exits.
+	ML_CHECK_ARG_COUNT(1);
+	ML_CHECK_ARG_TYPE(0, MLStringT);
+	const char *Name = ml_string_value(Args[0]);
+	worker_t **Slot = (worker_t **)stringmap_slot(Workers, Name);
+	if (!Slot[0]) {
+		worker_t *Worker = Slot[0] = new(worker_t);
+		Worker->Type = WorkerT;
+		Worker->Name = Name;
+		Worker->Limit = DefaultWorkerLimit;
+		Worker->WaitingTail = &Worker->Waiting;
+		pthread_cond_init(Worker->Available, NULL);
+	}
+	worker_t *Worker = Slot[0];
+	if (Count > 1) {
+		ml_value_t *ArgList = worker_argify(ml_list(), 1, Args + 1);
+		if (ml_is_error(ArgList)) return ArgList;
+		int Argc = ml_list_length(ArgList);
+		if (!Argc) return ml_error("ValueError", "Worker command must not be empty");
+		const char **Argv = anew(const char *, Argc + 1);
+		const char **Argp = Argv;
+		ML_LIST_FOREACH(ArgList, Node) *Argp++ = ml_string_value(Node->Value);
+		Worker->Argv = Argv;
+	}
+	if (Count > 2) {
+		ML_CHECK_ARG_TYPE(2, MLIntegerT);
+		int Limit = ml_integer_value(Args[2]);
+		if (Limit < 1) return ml_error("ValueError", "Worker limit must be positive");
+		Worker->Limit = Limit;
+	}
+	if (!Worker->Argv) return ml_error("ValueError", "Worker %s has no command", Name);
+	return (ml_value_t *)Worker;
+}
+
+ML_TYPE(WorkerT, (), "worker",
+// A pool of persistent tool processes.
+	.Constructor = (ml_value_t *)Worker
+);
+
+ML_METHOD("name", WorkerT) {
+//<Worker
+//>string
+// Returns the name of :mini:`Worker`.
+	worker_t *Worker = (worker_t *)Args[0];
+	return ml_string(Worker->Name, -1);
+}
+
+ML_METHOD("limit", WorkerT) {
+//<Worker
+//>integer
+// Returns the maximum number of processes started for :mini:`Worker`.
+	worker_t *Worker = (worker_t *)Args[0];
+	return ml_integer(Worker->Limit);
+}
+
+static worker_process_t *worker_spawn(worker_t *Worker) {
+	// A socket is used instead of pipes so writing to a worker that has exited fails instead of raising SIGPIPE.
+	int Socket[2];
+	// Commands started by other threads must not inherit the socket, otherwise the worker would not see end of file when rabs exits.
+	// The descriptors created by dup2 in the worker do not have close-on-exec set.
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, Socket) == -1) return NULL;
+	pid_t Pid = fork();
+	if (!Pid) {
+		setpgid(0, 0);
+		if (chdir(RootPath)) _exit(127);
+		dup2(Socket[1], STDIN_FILENO);
+		dup2(Socket[1], STDOUT_FILENO);
+		close(Socket[1]);
+		execvp(Worker->Argv[0], (char * const *)Worker->Argv);
+		_exit(127);
+	}
+	close(Socket[1]);
+	if (Pid == -1) {
+		close(Socket[0]);
+		return NULL;
+	}
+	// Also set in the parent so the group exists before worker_discard or worker_kill can signal it
+	setpgid(Pid, Pid);
+	worker_process_t *Process = new(worker_process_t);
+	Process->Pid = Pid;
+	Process->Fd = Socket[0];
+	Process->AllNext = AllProcesses;
+	AllProcesses = Process;
+	return Process;
+}
+
+static void worker_discard(worker_t *Worker, worker_process_t *Process);
+
+static int worker_stale(worker_process_t *Process) {
+	// An idle process must have nothing left to read, otherwise it has exited or written output nobody asked for.
+	char Char;
+	ssize_t Length;
+	do Length = recv(Process->Fd, &Char, 1, MSG_PEEK | MSG_DONTWAIT); while (Length < 0 && errno == EINTR);
+	return Length >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+static worker_process_t *worker_acquire(worker_t *Worker) {
+	// Returns NULL if every process is busy (Worker->Count == Worker->Limit) or a new one could not be started.
+	worker_process_t *Process;
+	while ((Process = Worker->Idle)) {
+		Worker->Idle = Process->Next;
+		if (!worker_stale(Process)) return Process;
+		worker_discard(Worker, Process);
+	}
+	if (Worker->Count < Worker->Limit) {
+		Process = worker_spawn(Worker);
+		if (Process) ++Worker->Count;
+	}
+	return Process;
+}
+
+static void worker_wake(worker_t *Worker) {
+	// Resumes the oldest suspended request, it acquires a process again so it may be suspended again if another caller was first.
+	worker_request_t *Request = Worker->Waiting;
+	if (Request) {
+		if (!(Worker->Waiting = Request->Next)) Worker->WaitingTail = &Worker->Waiting;
+		target_resume_queue(Request->Resume);
+	}
+	pthread_cond_signal(Worker->Available);
+}
+
+static void worker_release(worker_t *Worker, worker_process_t *Process) {
+	Process->Next = Worker->Idle;
+	Worker->Idle = Process;
+	worker_wake(Worker);
+}
+
+static void worker_discard(worker_t *Worker, worker_process_t *Process) {
+	// The process has exited or stopped following the protocol, a new one is started when needed.
+	close(Process->Fd);
+	killpg(Process->Pid, SIGKILL);
+	waitpid(Process->Pid, NULL, 0);
+	Process->Pid = 0;
+	--Worker->Count;
+	worker_wake(Worker);
+}
+
+static int worker_send(worker_process_t *Process, const char *Chars, size_t Length) {
+	int Fd = Process->Fd;
+	while (Length) {
+		ssize_t Sent = send(Fd, Chars, Length, MSG_NOSIGNAL);
+		if (Sent < 0) {
+			if (errno == EINTR) continue;
+			return 1;
+		}
+		Chars += Sent;
+		Length -= Sent;
+	}
+	return 0;
+}
+
+static void worker_json_string(ml_stringbuffer_t *Buffer, const char *Chars, size_t Length) {
+	ml_stringbuffer_put(Buffer, '\"');
+	for (size_t I = 0; I < Length; ++I) {
+		unsigned char Char = Chars[I];
+		switch (Char) {
+		case '\"': ml_stringbuffer_write(Buffer, "\\\"", 2); break;
+		case '\\': ml_stringbuffer_write(Buffer, "\\\\", 2); break;
+		case '\n': ml_stringbuffer_write(Buffer, "\\n", 2); break;
+		case '\r': ml_stringbuffer_write(Buffer, "\\r", 2); break;
+		case '\t': ml_stringbuffer_write(Buffer, "\\t", 2); break;
+		default:
+			if (Char < 0x20) {
+				ml_stringbuffer_printf(Buffer, "\\u%04x", Char);
+			} else {
+				ml_stringbuffer_put(Buffer, Char);
+			}
+		}
+	}
+	ml_stringbuffer_put(Buffer, '\"');
+}
+
+static const char *worker_json_space(const char *P) {
+	while (*P == ' ' || *P == '\t' || *P == '\r' || *P == '\n') ++P;
+	return P;
+}
+
+static int worker_json_hex(const char *P, unsigned int *Value) {
+	unsigned int Result = 0;
+	for (int I = 0; I < 4; ++I) {
+		char Char = P[I];
+		Result <<= 4;
+		if ('0' <= Char && Char <= '9') {
+			Result += Char - '0';
+		} else if ('a' <= Char && Char <= 'f') {
+			Result += Char - 'a' + 10;
+		} else if ('A' <= Char && Char <= 'F') {
+			Result += Char - 'A' + 10;
+		} else {
+			return 1;
+		}
+	}
+	*Value = Result;
+	return 0;
+}
+
+static char *worker_utf8(char *Q, unsigned int Code) {
+	if (Code < 0x80) {
+		*Q++ = Code;
+	} else if (Code < 0x800) {
+		*Q++ = 0xC0 | (Code >> 6);
+		*Q++ = 0x80 | (Code & 0x3F);
+	} else if (Code < 0x10000) {
+		*Q++ = 0xE0 | (Code >> 12);
+		*Q++ = 0x80 | ((Code >> 6) & 0x3F);
+		*Q++ = 0x80 | (Code & 0x3F);
+	} else {
+		*Q++ = 0xF0 | (Code >> 18);
+		*Q++ = 0x80 | ((Code >> 12) & 0x3F);
+		*Q++ = 0x80 | ((Code >> 6) & 0x3F);
+		*Q++ = 0x80 | (Code & 0x3F);
+	}
+	return Q;
+}
+
+static const char *worker_json_parse_string(const char *P, char **Value, size_t *Length) {
+	// P points at the opening quote, the decoded string is never longer than the encoded one.
+	char *String = GC_MALLOC_ATOMIC(strlen(P) + 1), *Q = String;
+	++P;
+	while (*P != '\"') {
+		if (!*P) return NULL;
+		if (*P != '\\') {
+			*Q++ = *P++;
+			continue;
+		}
+		++P;
+		switch (*P++) {
+		case '\"': *Q++ = '\"'; break;
+		case '\\': *Q++ = '\\'; break;
+		case '/': *Q++ = '/'; break;
+		case 'b': *Q++ = '\b'; break;
+		case 'f': *Q++ = '\f'; break;
+		case 'n': *Q++ = '\n'; break;
+		case 'r': *Q++ = '\r'; break;
+		case 't': *Q++ = '\t'; break;
+		case 'u': {
+			unsigned int Code, Low;
+			if (worker_json_hex(P, &Code)) return NULL;
+			P += 4;
+			if (0xD800 <= Code && Code < 0xDC00 && P[0] == '\\' && P[1] == 'u' && !worker_json_hex(P + 2, &Low) && 0xDC00 <= Low && Low < 0xE000) {
+				Code = 0x10000 + ((Code - 0xD800) << 10) + (Low - 0xDC00);
+				P += 6;
+			}
+			Q = worker_utf8(Q, Code);
+			break;
+		}
+		default: return NULL;
+		}
+	}
+	*Q = 0;
+	*Value = String;
+	*Length = Q - String;
+	return P + 1;
+}
+
+static const char *worker_json_skip(const char *P) {
+	// Skips over a value of any other field, stopping at the following comma or closing brace.
+	int Depth = 0;
+	while (*P) {
+		if (*P == '\"') {
+			++P;
+			while (*P != '\"') {
+				if (!*P) return NULL;
+				if (*P++ == '\\' && !*P++) return NULL;
+			}
+		} else if (*P == '{' || *P == '[') {
+			++Depth;
+		} else if (*P == '}' || *P == ']' || *P == ',') {
+			if (!Depth) return P;
+			if (*P != ',') --Depth;
+		}
+		++P;
+	}
+	return NULL;
+}
+
+typedef struct {
+	char *Output;
+	size_t Length;
+	long ExitCode;
+} worker_response_t;
+
+static int worker_json_parse_response(const char *P, worker_response_t *Response) {
+	P = worker_json_space(P);
+	if (*P++ != '{') return 1;
+	P = worker_json_space(P);
+	if (*P == '}') return 0;
+	for (;;) {
+		char *Key;
+		size_t KeyLength;
+		if (*P != '\"' || !(P = worker_json_parse_string(P, &Key, &KeyLength))) return 1;
+		P = worker_json_space(P);
+		if (*P++ != ':') return 1;
+		P = worker_json_space(P);
+		if (!strcmp(Key, "exitCode")) {
+			char *End;
+			Response->ExitCode = strtol(P, &End, 10);
+			if (End == P) return 1;
+			P = End;
+		} else if (!strcmp(Key, "output")) {
+			if (*P != '\"' || !(P = worker_json_parse_string(P, &Response->Output, &Response->Length))) return 1;
+		} else if (!(P = worker_json_skip(P))) {
+			return 1;
+		}
+		P = worker_json_space(P);
+		if (*P == '}') return 0;
+		if (*P++ != ',') return 1;
+		P = worker_json_space(P);
+	}
+}
+
+static void worker_append(worker_request_t *Request, const char *Chars, size_t Length) {
+	// Room is always left for the terminating nul byte
+	size_t Size = Request->ResponseSize;
+	if (Request->ResponseLength + Length >= Size) {
+		do Size = Size ? 2 * Size : 256; while (Request->ResponseLength + Length >= Size);
+		char *Response = GC_MALLOC_ATOMIC(Size);
+		if (Request->Response) memcpy(Response, Request->Response, Request->ResponseLength);
+		Request->Response = Response;
+		Request->ResponseSize = Size;
+	}
+	memcpy(Request->Response + Request->ResponseLength, Chars, Length);
+	Request->ResponseLength += Length;
+	Request->Response[Request->ResponseLength] = 0;
+}
+
+static int worker_read(worker_request_t *Request, int Flags) {
+	// Returns 1 once the response line has been read, 0 if more is needed (only with MSG_DONTWAIT) and -1 if the process has exited.
+	// Exactly one line is expected, so any bytes after its newline mean the process is out of step with its requests.
+	char Chars[4096];
+	for (;;) {
+		ssize_t Length = recv(Request->Process->Fd, Chars, sizeof(Chars), Flags);
+		if (Length < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		if (!Length) return -1;
+		char *End = memchr(Chars, '\n', Length);
+		if (End) {
+			if (End + 1 != Chars + Length) return -1;
+			worker_append(Request, Chars, End - Chars);
+			return 1;
+		}
+		worker_append(Request, Chars, Length);
+	}
+}
+
+static void worker_finish(ml_state_t *Caller, worker_request_t *Request, int Error) {
+	jobserver_release(Request->Token);
+	worker_t *Worker = Request->Worker;
+	worker_process_t *Process = Request->Process;
+	if (Error) {
+		worker_discard(Worker, Process);
+		ML_RETURN(ml_error("WorkerError", "worker %s exited unexpectedly", Worker->Name));
+	}
+	worker_response_t Response[1] = {{NULL, 0, 0}};
+	if (worker_json_parse_response(Request->Response ?: "", Response)) {
+		worker_discard(Worker, Process);
+		ML_RETURN(ml_error("WorkerError", "invalid response from worker %s", Worker->Name));
+	}
+	worker_release(Worker, Process);
+	if (Response->ExitCode) {
+		ml_value_t *Result = ml_error("ExecuteError", "worker %s returned non-zero exit code: %s", Worker->Name, Response->Output ?: "");
+		ml_error_trace_add(Result, (ml_source_t){Worker->Name, Response->ExitCode});
+		ML_RETURN(Result);
+	}
+	ML_RETURN(ml_string(Response->Output ?: "", Response->Length));
+}
+
+static void worker_wait(ml_state_t *Caller, worker_request_t *Request);
+
+static void worker_readable(ml_state_t *Caller, target_t *Depend, ml_value_t **Args) {
+	worker_request_t *Request = (worker_request_t *)Args[0];
+	int Read = worker_read(Request, MSG_DONTWAIT);
+	if (!Read) return worker_wait(Caller, Request);
+	worker_finish(Caller, Request, Read < 0);
+}
+
+static void worker_wait(ml_state_t *Caller, worker_request_t *Request) {
+	if (target_suspendable()) {
+		// Suspend the calling build function until the process writes something, the reactor resumes it on a build thread
+		ml_value_t *ResumeArgs[1] = {(ml_value_t *)Request};
+		Request->Resume = target_suspend(Caller, worker_readable, 1, ResumeArgs);
+		if (!process_watch_async(Request->Process->Fd, (process_ready_fn)target_resume_later, Request->Resume)) return;
+		target_suspend_cancel(Request->Resume);
+	}
+	pthread_mutex_unlock(InterpreterLock);
+	int Read = worker_read(Request, 0);
+	pthread_mutex_lock(InterpreterLock);
+	worker_finish(Caller, Request, Read < 0);
+}
+
+static void worker_start(ml_state_t *Caller, worker_request_t *Request);
+
+static void worker_available(ml_state_t *Caller, target_t *Depend, ml_value_t **Args) {
+	worker_start(Caller, (worker_request_t *)Args[0]);
+}
+
+static void worker_start(ml_state_t *Caller, worker_request_t *Request) {
+	worker_t *Worker = Request->Worker;
+	worker_process_t *Process;
+	while (!(Process = worker_acquire(Worker)) && Worker->Count >= Worker->Limit) {
+		if (target_suspendable()) {
+			// Queue the request instead of blocking this build thread, worker_release() resumes it
+			ml_value_t *ResumeArgs[1] = {(ml_value_t *)Request};
+			Request->Resume = target_suspend(Caller, worker_available, 1, ResumeArgs);
+			Request->Next = NULL;
+			Worker->WaitingTail[0] = Request;
+			Worker->WaitingTail = &Request->Next;
+			return;
+		}
+		pthread_cond_wait(Worker->Available, InterpreterLock);
+	}
+	if (!Process) ML_RETURN(ml_error("WorkerError", "failed to start worker %s", Worker->Name));
+	Request->Process = Process;
+	Request->Token = jobserver_acquire();
+	pthread_mutex_unlock(InterpreterLock);
+	int Error = worker_send(Process, Request->Chars, Request->Length);
+	pthread_mutex_lock(InterpreterLock);
+	if (Error) return worker_finish(Caller, Request, 1);
+	worker_wait(Caller, Request);
+}
+
+ML_METHODVX("execute", WorkerT) {
+//<Worker
+//<Argument..:any
+//>string|error
+// Sends a request with the arguments built from :mini:`Argument..` (as for :mini:`execv()`) and the current directory to an idle process of :mini:`Worker`, starting a new process if none are idle and fewer than the limit are running.
+// Returns the output of the response if its exit code is 0, otherwise raises an error including the output.
+	worker_t *Worker = (worker_t *)Args[0];
+	ml_value_t *ArgList = worker_argify(ml_list(), Count - 1, Args + 1);
+	if (ml_is_error(ArgList)) ML_RETURN(ArgList);
+	ml_stringbuffer_t Buffer[1] = {ML_STRINGBUFFER_INIT};
+	ml_stringbuffer_write(Buffer, "{\"arguments\": [", strlen("{\"arguments\": ["));
+	int First = 1;
+	ML_LIST_FOREACH(ArgList, Node) {
+		if (!First) ml_stringbuffer_write(Buffer, ", ", 2);
+		First = 0;
+		worker_json_string(Buffer, ml_string_value(Node->Value), ml_string_length(Node->Value));
+	}
+	ml_stringbuffer_write(Buffer, "], \"inputs\": [], \"requestId\": 0, \"directory\": ", strlen("], \"inputs\": [], \"requestId\": 0, \"directory\": "));
+	worker_json_string(Buffer, CurrentDirectory, strlen(CurrentDirectory));
+	ml_stringbuffer_write(Buffer, "}\n", 2);
+	worker_request_t *Request = new(worker_request_t);
+	Request->Worker = Worker;
+	Request->Length = Buffer->Length;
+	Request->Chars = ml_stringbuffer_get_string(Buffer);
+	return worker_start(Caller, Request);
+}
+
+static void worker_kill(void) {
+	for (worker_process_t *Process = AllProcesses; Process; Process = Process->AllNext) {
+		if (Process->Pid) killpg(Process->Pid, SIGTERM);
+	}
+}
+
+static int worker_fork_reset(const char *Name, worker_t *Worker, void *Data) {
+	Worker->Idle = NULL;
+	Worker->Waiting = NULL;
+	Worker->WaitingTail = &Worker->Waiting;
+	Worker->Count = 0;
+	return 0;
+}
+
+void worker_fork_child() {
+	// Processes started by the parent stay with the parent, a forked build starts its own if it needs any.
+	stringmap_foreach(Workers, NULL, (void *)worker_fork_reset);
+	AllProcesses = NULL;
+}
+
+void worker_init() {
+	ArgifyMethod = ml_method("argify");
+	atexit(worker_kill);
+#ifndef GENERATE_INIT
+#include "worker_init.c"
+#endif
+}
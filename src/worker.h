@@ -0,0 +1,28 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include "minilang.h"
+
+typedef struct worker_t worker_t;
+typedef struct worker_process_t worker_process_t;
+typedef struct worker_request_t worker_request_t;
+
+struct worker_t {
+	const ml_type_t *Type;
+	const char *Name;
+	const char **Argv;
+	worker_process_t *Idle;
+	worker_request_t *Waiting, **WaitingTail;
+	pthread_cond_t Available[1];
+	int Limit, Count;
+};
+
+extern ml_type_t WorkerT[];
+extern int DefaultWorkerLimit;
+
+void worker_init();
+void worker_fork_child();
+
+#endif